@@ -0,0 +1,71 @@
+/**
+ * Shared by the benchmarks. Each one prints its results as a single line
+ * JSON object, tagged with the revision it was built from, so runs of
+ * `make bench` can be compared across revisions.
+ */
+#ifndef SHELLAX_BENCH_H
+#define SHELLAX_BENCH_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+static inline double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Percentile of samples, sorting them in place
+ * @param  samples [description]
+ * @param  count   [description]
+ * @param  p       between 0 and 1
+ * @return         [description]
+ */
+static inline double percentile(double *samples, int count, double p)
+{
+    qsort(samples, count, sizeof(double), compare_doubles);
+    int i = p * (count - 1) + 0.5;
+    return samples[i];
+}
+
+/**
+ * Remove a chat room the benchmark made: its FIFOs and its message log
+ * @param room_dir [description]
+ */
+static inline void remove_room(const char *room_dir)
+{
+    DIR *dir = opendir(room_dir);
+    struct dirent *ent;
+    char path[4096];
+    while (dir && (ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", room_dir, ent->d_name) >= (int)sizeof(path))
+            continue;
+        if (unlink(path) == -1 && errno == EISDIR)
+            remove_room(path);
+    }
+    if (dir)
+        closedir(dir);
+    rmdir(room_dir);
+}
+
+#endif
@@ -0,0 +1,159 @@
+/**
+ * Chatroom latency benchmark: starts a sender and a receiver in a fresh room
+ * and measures how long each message typed into the sender takes to show up
+ * on the receiver's output, one message in flight at a time.
+ *
+ * make bench/chat_bench
+ * bench/chat_bench <chatroom> [messages]
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define CHAT_TIMEOUT_MS 5000 // for a member to join
+#define CHAT_LOST_MS 250      // a message that takes longer counts as lost
+
+/**
+ * Start a chatroom member in its own process group
+ * @param  chatroom binary
+ * @param  room     [description]
+ * @param  user     [description]
+ * @param  in_fd    its stdin
+ * @param  out_fd   its stdout
+ * @return          pid, which is also its process group
+ */
+pid_t start_member(const char *chatroom, const char *room, const char *user, int in_fd,
+                   int out_fd)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        setpgid(0, 0);
+        dup2(in_fd, STDIN_FILENO);
+        dup2(out_fd, STDOUT_FILENO);
+        execl(chatroom, chatroom, room, user, (char *)NULL);
+        _exit(127);
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+// wait until a member's FIFO exists, it can not be sent to before
+int wait_for_member(const char *room_dir, const char *user)
+{
+    char path[4096];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", room_dir, user);
+    for (int i = 0; i < CHAT_TIMEOUT_MS; i++)
+    {
+        if (stat(path, &st) == 0)
+            return 0;
+        usleep(1000);
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <chatroom> [messages]\n", argv[0]);
+        return 2;
+    }
+    const char *chatroom = argv[1];
+    int count = argc > 2 ? atoi(argv[2]) : 200;
+    signal(SIGPIPE, SIG_IGN);
+
+    char room[64], room_dir[128];
+    snprintf(room, sizeof(room), "bench-%d", getpid());
+    snprintf(room_dir, sizeof(room_dir), "/tmp/chatroom-%s", room);
+
+    // the receiver's stdin stays open and silent, the sender's output is unused
+    int to_sender[2], to_receiver[2], from_receiver[2];
+    pipe2(to_sender, O_CLOEXEC);
+    pipe2(to_receiver, O_CLOEXEC);
+    pipe2(from_receiver, O_CLOEXEC);
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    pid_t receiver = start_member(chatroom, room, "receiver", to_receiver[0], from_receiver[1]);
+    if (wait_for_member(room_dir, "receiver") == -1)
+    {
+        fprintf(stderr, "chat_bench: receiver did not join %s\n", room_dir);
+        kill(-receiver, SIGKILL);
+        return 1;
+    }
+    pid_t sender = start_member(chatroom, room, "sender", to_sender[0], null_fd);
+    close(from_receiver[1]);
+    int failed = wait_for_member(room_dir, "sender");
+
+    double *latencies = malloc(count * sizeof(double));
+    char buf[1 << 16];
+    size_t len = 0;
+    int received = 0, lost = 0;
+    for (int i = 0; i < count && !failed; i++)
+    {
+        char message[64], needle[64];
+        int n = snprintf(message, sizeof(message), "ping %d\n", i);
+        snprintf(needle, sizeof(needle), "ping %d\n", i);
+        double start = now();
+        if (write(to_sender[1], message, n) != n)
+            break;
+        // read until the message shows up, the receiver's prompts in between
+        bool arrived = true;
+        while (memmem(buf, len, needle, strlen(needle)) == NULL)
+        {
+            struct pollfd pfd = {from_receiver[0], POLLIN, 0};
+            if (len == sizeof(buf))
+                len = 0; // only the tail matters
+            int timeout = CHAT_LOST_MS - (now() - start) * 1e3;
+            if (timeout <= 0 || poll(&pfd, 1, timeout) == 0)
+            {
+                arrived = false;
+                break;
+            }
+            ssize_t r = read(from_receiver[0], buf + len, sizeof(buf) - len);
+            if (r <= 0)
+            {
+                failed = 1;
+                break;
+            }
+            len += r;
+        }
+        if (failed)
+            break;
+        if (arrived)
+            latencies[received++] = (now() - start) * 1e6;
+        else
+            lost++;
+        len = 0;
+    }
+
+    kill(-sender, SIGKILL);
+    kill(-receiver, SIGKILL);
+    waitpid(sender, NULL, 0);
+    waitpid(receiver, NULL, 0);
+    remove_room(room_dir);
+
+    if (received == 0)
+    {
+        printf("{\"bench\": \"chat\", \"revision\": \"%s\", \"error\": \"no message arrived\"}\n",
+               BENCH_REVISION);
+        return 1;
+    }
+    double sum = 0;
+    for (int i = 0; i < received; i++)
+        sum += latencies[i];
+    printf("{\"bench\": \"chat\", \"revision\": \"%s\", \"messages\": %d, \"lost\": %d, "
+           "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f}\n",
+           BENCH_REVISION, received, lost, sum / received,
+           percentile(latencies, received, 0.5), percentile(latencies, received, 0.99));
+    return 0;
+}
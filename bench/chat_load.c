@@ -0,0 +1,336 @@
+/**
+ * Chatroom load generator: starts N members in a fresh room, has every one
+ * of them type messages at a steady rate for a while and reads what each
+ * member prints. Every message should reach every member, the sender
+ * included; delivery latency is from the moment the message was written to
+ * the sender's stdin until a member printed it, and a delivery that never
+ * came within the grace period counts as lost.
+ *
+ * make bench/chat_load
+ * bench/chat_load [-t transport] [-u users] [-r rate] [-d seconds] [-g grace] <chatroom>
+ *
+ *   -t  passed on to chatroom -t, fifo by default
+ *   -u  members in the room, 10 by default
+ *   -r  messages each member sends per second, 1 by default
+ *   -d  seconds of sending, 5 by default
+ *   -g  seconds to wait for late deliveries after, 1 by default
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define LOAD_JOIN_SECONDS 60 // for every member to print its first prompt
+#define LOAD_SETTLE_MS 200   // for the members to find each other after
+
+struct user
+{
+    pid_t pid;
+    int in_fd;  // its stdin, written to
+    int out_fd; // its stdout, read from
+    bool joined;
+    uint64_t seq;
+    char buf[8192]; // output up to an incomplete line
+    size_t len;
+};
+
+struct load
+{
+    struct user *users;
+    int count;
+    double *latencies; // microseconds
+    size_t delivered, capacity;
+    uint64_t sent, stalled;
+    double last_delivery;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Start a chatroom member in its own process group, with its stdin and
+ * stdout on pipes of ours
+ * @param  user      [description]
+ * @param  chatroom  binary
+ * @param  transport [description]
+ * @param  room      [description]
+ * @param  name      [description]
+ * @return           0, -1 on failure
+ */
+int start_user(struct user *user, const char *chatroom, const char *transport, const char *room,
+               const char *name)
+{
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) == -1)
+        return -1;
+    if (pipe2(out, O_CLOEXEC) == -1)
+    {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    user->pid = fork();
+    if (user->pid == 0)
+    {
+        setpgid(0, 0);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDERR_FILENO); // lost message reports of a thousand members
+        execl(chatroom, chatroom, "-t", transport, room, name, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (user->pid == -1)
+    {
+        close(in[1]);
+        close(out[0]);
+        return -1;
+    }
+    setpgid(user->pid, user->pid);
+    user->in_fd = in[1];
+    user->out_fd = out[0];
+    // a member busy broadcasting must not stall the others' input
+    fcntl(user->in_fd, F_SETFL, O_NONBLOCK);
+    fcntl(user->out_fd, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+/**
+ * Read what a member printed and record every load message in it
+ * @param  load [description]
+ * @param  user [description]
+ * @return      0, -1 once the member exited
+ */
+int read_user(struct load *load, struct user *user)
+{
+    ssize_t n;
+    while ((n = read(user->out_fd, user->buf + user->len, sizeof(user->buf) - user->len)) > 0)
+    {
+        // the first thing a member prints is its prompt, once it has joined
+        user->joined = true;
+        user->len += n;
+        char *line = user->buf, *end = user->buf + user->len, *newline;
+        double received = now_ns() / 1e3;
+        while ((newline = memchr(line, '\n', end - line)) != NULL)
+        {
+            *newline = 0;
+            char *text = strstr(line, ":load ");
+            unsigned long long sent_ns;
+            if (text != NULL && sscanf(text, ":load %*d %*u %llu", &sent_ns) == 1)
+            {
+                if (load->delivered == load->capacity)
+                {
+                    load->capacity = load->capacity ? 2 * load->capacity : 1 << 16;
+                    load->latencies = realloc(load->latencies, load->capacity * sizeof(double));
+                }
+                load->latencies[load->delivered++] = received - sent_ns / 1e3;
+                load->last_delivery = received / 1e6;
+            }
+            line = newline + 1;
+        }
+        if (line == user->buf && user->len == sizeof(user->buf))
+            line = end; // no line is that long, drop it
+        user->len = end - line;
+        memmove(user->buf, line, user->len);
+    }
+    return n == 0 ? -1 : 0;
+}
+
+/**
+ * Type the next message into a member
+ * @param load [description]
+ * @param i    member index
+ */
+void send_message(struct load *load, int i)
+{
+    struct user *user = &load->users[i];
+    char message[128];
+    int len = snprintf(message, sizeof(message), "load %d %llu %llu\n", i,
+                       (unsigned long long)user->seq, (unsigned long long)now_ns());
+    if (write(user->in_fd, message, len) == len)
+    {
+        user->seq++;
+        load->sent++;
+    }
+    else
+        load->stalled++; // its stdin is full, the member fell behind
+}
+
+/**
+ * Wait for events from the members, reading their output
+ * @param  load     [description]
+ * @param  epoll_fd [description]
+ * @param  timeout  milliseconds
+ * @return          members that exited
+ */
+int poll_users(struct load *load, int epoll_fd, int timeout)
+{
+    struct epoll_event events[64];
+    int exited = 0;
+    int n = epoll_wait(epoll_fd, events, 64, timeout);
+    for (int i = 0; i < n; i++)
+    {
+        struct user *user = &load->users[events[i].data.u32];
+        if (read_user(load, user) == -1)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, user->out_fd, NULL);
+            exited++;
+        }
+    }
+    return exited;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *transport = "fifo";
+    int count = 10;
+    double rate = 1, duration = 5, grace = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:u:r:d:g:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            transport = optarg;
+            break;
+        case 'u':
+            count = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'g':
+            grace = atof(optarg);
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (optind >= argc || count < 1 || rate <= 0)
+    {
+        fprintf(stderr, "usage: %s [-t transport] [-u users] [-r rate] [-d seconds] "
+                        "[-g grace] <chatroom>\n", argv[0]);
+        return 2;
+    }
+    const char *chatroom = argv[optind];
+    signal(SIGPIPE, SIG_IGN);
+    // two pipes per member here, a FIFO per member in every FIFO member
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    char room[64], room_dir[128];
+    snprintf(room, sizeof(room), "load-%d", getpid());
+    snprintf(room_dir, sizeof(room_dir), "/tmp/chatroom-%s", room);
+
+    struct load load = {.count = count};
+    load.users = calloc(count, sizeof(struct user));
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int started = 0, exited = 0;
+    const char *error = NULL;
+    for (; started < count; started++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "u%d", started);
+        if (start_user(&load.users[started], chatroom, transport, room, name) == -1)
+        {
+            error = "could not start every member";
+            break;
+        }
+        struct epoll_event event = {.events = EPOLLIN, .data.u32 = started};
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, load.users[started].out_fd, &event);
+    }
+
+    // everybody in, before anybody talks
+    int joined = 0;
+    double deadline = now() + LOAD_JOIN_SECONDS;
+    while (!error && joined < count)
+    {
+        exited += poll_users(&load, epoll_fd, 100);
+        joined = 0;
+        for (int i = 0; i < count; i++)
+            joined += load.users[i].joined;
+        if (exited > 0)
+            error = "a member exited";
+        else if (now() > deadline)
+            error = "not every member joined";
+    }
+    double settle = now() + LOAD_SETTLE_MS / 1e3;
+    while (!error && now() < settle)
+        poll_users(&load, epoll_fd, LOAD_SETTLE_MS);
+
+    // members take turns, spread evenly over the whole rate of the room
+    double interval = 1 / (rate * count), start = now(), end = start + duration;
+    double next = start;
+    int turn = 0;
+    while (!error && now() < end)
+    {
+        double t = now();
+        while (next <= t && next < end)
+        {
+            send_message(&load, turn);
+            turn = (turn + 1) % count;
+            next += interval;
+        }
+        int timeout = next > t ? (next - t) * 1e3 : 0;
+        exited += poll_users(&load, epoll_fd, timeout);
+    }
+    // late deliveries
+    double drain = now() + grace;
+    while (!error && load.delivered < load.sent * count && now() < drain)
+        exited += poll_users(&load, epoll_fd, (drain - now()) * 1e3 + 1);
+
+    for (int i = 0; i < started; i++)
+        kill(-load.users[i].pid, SIGTERM); // members unlink their FIFOs
+    for (int i = 0; i < started; i++)
+        waitpid(load.users[i].pid, NULL, 0);
+    remove_room(room_dir);
+    char shm_name[128];
+    snprintf(shm_name, sizeof(shm_name), "/chatroom-%s", room);
+    shm_unlink(shm_name);
+
+    if (error || load.delivered == 0)
+    {
+        printf("{\"bench\": \"chat_load\", \"revision\": \"%s\", \"transport\": \"%s\", "
+               "\"users\": %d, \"error\": \"%s\"}\n",
+               BENCH_REVISION, transport, count, error ? error : "no message arrived");
+        return 1;
+    }
+    uint64_t expected = load.sent * count;
+    uint64_t lost = expected > load.delivered ? expected - load.delivered : 0;
+    double elapsed = load.last_delivery - start;
+    double max = 0;
+    for (size_t i = 0; i < load.delivered; i++)
+        if (load.latencies[i] > max)
+            max = load.latencies[i];
+    double p50 = percentile(load.latencies, load.delivered, 0.5);
+    double p99 = percentile(load.latencies, load.delivered, 0.99);
+    printf("{\"bench\": \"chat_load\", \"revision\": \"%s\", \"transport\": \"%s\", "
+           "\"users\": %d, \"rate\": %g, \"seconds\": %g, \"sent\": %llu, \"stalled\": %llu, "
+           "\"delivered\": %zu, \"lost\": %llu, \"loss\": %.4f, \"deliveries_per_s\": %.0f, "
+           "\"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}\n",
+           BENCH_REVISION, transport, count, rate, duration, (unsigned long long)load.sent,
+           (unsigned long long)load.stalled, load.delivered, (unsigned long long)lost,
+           expected ? (double)lost / expected : 0, load.delivered / elapsed, p50, p99, max);
+    return 0;
+}
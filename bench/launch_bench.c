@@ -0,0 +1,155 @@
+/**
+ * Launch latency benchmark: starts /bin/true with the posix_spawn and the
+ * fork launchers of the shell and waits for it, once from a small shell and
+ * once after the shell has touched a few hundred megabytes, which is what
+ * makes fork slow. Then runs `uniq < file | cat` the way an interactive
+ * shell runs a line, and fails if uniq was forked instead of run on a thread.
+ *
+ * make bench/launch_bench
+ * bench/launch_bench [launches] [resident MB]
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+
+/**
+ * Launch the command count times with one launcher
+ * @return microseconds per launch, waiting included
+ */
+double run(LAUNCHER which, struct command_t *command, const char *path, int count)
+{
+    double start = now();
+    for (int i = 0; i < count; i++)
+    {
+        pid_t pid = which == LAUNCH_SPAWN
+                        ? spawn_command(command, path, -1, -1, 0, NULL, 0)
+                        : fork_command(command, path, -1, -1, 0, NULL, 0, NULL, 0);
+        if (pid == -1)
+        {
+            perror("launch");
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return (now() - start) / count * 1e6;
+}
+
+/**
+ * Run a builtin pipeline count times as an interactive shell, with stdin the
+ * controlling terminal
+ * @return microseconds per pipeline, -1 if the builtin was forked
+ */
+double run_pipeline(const char *file, int count)
+{
+    // what main sets up for an interactive shell
+    interactive = true;
+    shell_pgid = getpgrp();
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    char line[256];
+    snprintf(line, sizeof(line), "uniq < %s | cat > /dev/null", file);
+    double start = now();
+    for (int i = 0; i < count; i++)
+    {
+        struct command_t *command = arena_alloc(&command_arena, sizeof(struct command_t));
+        parse_command(arena_strdup(&command_arena, line), command);
+        process_command(command);
+        free_command(command);
+    }
+    double us = (now() - start) / count * 1e6;
+    // only forked stages are counted in the statistics
+    if (command_stats_capacity && *command_stats_slot("uniq") != NULL)
+        return -1;
+    return us;
+}
+
+/**
+ * Run the builtin pipelines in a child with a terminal of its own, so the
+ * job control of the shell works as it does on the user's terminal
+ * @return microseconds per pipeline, -1 on failure
+ */
+double run_interactive(const char *file, int count)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    int result[2];
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1 ||
+        pipe(result) == -1)
+    {
+        perror("pty");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // the first terminal a session leader opens is its controlling one
+        setsid();
+        int tty = open(ptsname(master), O_RDWR);
+        double us = tty == -1 ? -1 : (dup2(tty, STDIN_FILENO), run_pipeline(file, count));
+        write(result[1], &us, sizeof(us));
+        _exit(0);
+    }
+    close(result[1]);
+    double us = -1;
+    if (pid == -1 || read(result[0], &us, sizeof(us)) != sizeof(us))
+        us = -1;
+    waitpid(pid, NULL, 0);
+    close(result[0]);
+    close(master);
+    return us;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t resident = (argc > 2 ? atoi(argv[2]) : 256) << 20;
+
+    struct command_t *command = arena_alloc(&command_arena, sizeof(struct command_t));
+    parse_command(arena_strdup(&command_arena, "true"), command);
+    build_argv(command);
+    const char *path = resolve_command("true");
+    if (path == NULL)
+    {
+        fprintf(stderr, "launch_bench: true: not found\n");
+        return 1;
+    }
+
+    run(LAUNCH_SPAWN, command, path, count / 10); // warm up
+    double spawn_small = run(LAUNCH_SPAWN, command, path, count);
+    double fork_small = run(LAUNCH_FORK, command, path, count);
+
+    char *ballast = malloc(resident);
+    memset(ballast, 1, resident); // fork has to copy the page tables of all of it
+    double spawn_large = run(LAUNCH_SPAWN, command, path, count);
+    double fork_large = run(LAUNCH_FORK, command, path, count);
+    free(ballast);
+
+    char file[] = "/tmp/launch_bench-XXXXXX";
+    int fd = mkstemp(file);
+    for (int i = 0; fd != -1 && i < 100; i++)
+        dprintf(fd, "line %d\nline %d\n", i, i);
+    double pipeline = fd == -1 ? -1 : run_interactive(file, count / 10);
+    if (fd != -1)
+    {
+        close(fd);
+        unlink(file);
+    }
+    if (pipeline == -1)
+    {
+        fprintf(stderr, "launch_bench: uniq | cat: uniq was forked or failed\n");
+        return 1;
+    }
+
+    printf("{\"bench\": \"launch\", \"revision\": \"%s\", \"launches\": %d, "
+           "\"spawn_us\": %.1f, \"fork_us\": %.1f, \"resident_mb\": %zu, "
+           "\"spawn_large_us\": %.1f, \"fork_large_us\": %.1f, "
+           "\"builtin_pipeline_us\": %.1f}\n",
+           BENCH_REVISION, count, spawn_small, fork_small, resident >> 20,
+           spawn_large, fork_large, pipeline);
+    return 0;
+}
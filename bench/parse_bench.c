@@ -0,0 +1,207 @@
+/**
+ * Parse throughput benchmark: lexes a generated script with parse_command and
+ * with the strtok based parser it replaced, and reports lines per second.
+ *
+ * make bench/parse_bench
+ * bench/parse_bench [lines] [rounds]
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+
+// the redirect slots command_t had when the legacy parser was current
+enum
+{
+    IN = 0,
+    OUT,
+    APPEND,
+};
+char *legacy_redirects[3];
+
+/**
+ * The strtok based parser parse_command replaced, kept verbatim for comparison
+ * except that the redirects go to legacy_redirects
+ * @param  buf     [description]
+ * @param  command [description]
+ * @return         0
+ */
+int legacy_parse_command(char *buf, struct command_t *command)
+{
+    const char *splitters = " \t"; // split at whitespace
+    int index, len;
+    len = strlen(buf);
+    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
+    {
+        buf++;
+        len--;
+    }
+    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
+        buf[--len] = 0; // trim right whitespace
+
+    if (len > 0 && buf[len - 1] == '&') // background
+        command->background = true;
+
+    char *pch = strtok(buf, splitters);
+    if (pch == NULL)
+    {
+        command->name = arena_alloc(&command_arena, 1);
+    }
+    else
+    {
+        command->name = arena_strdup(&command_arena, pch);
+    }
+
+    command->args = NULL;
+
+    int redirect_index;
+    int arg_index = 0;
+    char temp_buf[1024], *arg;
+    while (1)
+    {
+        // tokenize input on splitters
+        pch = strtok(NULL, splitters);
+        if (!pch)
+            break;
+        arg = temp_buf;
+        strcpy(arg, pch);
+        len = strlen(arg);
+
+        if (len == 0)
+            continue;                                        // empty arg, go for next
+        while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
+        {
+            arg++;
+            len--;
+        }
+        while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
+            arg[--len] = 0; // trim right whitespace
+        if (len == 0)
+            continue; // empty arg, go for next
+
+        // piping to another command
+        if (strcmp(arg, "|") == 0)
+        {
+            struct command_t *c = arena_alloc(&command_arena, sizeof(struct command_t));
+            int l = strlen(pch);
+            pch[l] = splitters[0]; // restore strtok termination
+            index = 1;
+            while (pch[index] == ' ' || pch[index] == '\t')
+                index++; // skip whitespaces
+
+            legacy_parse_command(pch + index, c);
+            pch[l] = 0; // put back strtok termination
+            command->next = c;
+            continue;
+        }
+
+        // background process
+        if (strcmp(arg, "&") == 0)
+            continue; // handled before
+                      // handle input redirection
+        redirect_index = -1;
+        memset(legacy_redirects, 0, sizeof(legacy_redirects));
+        if (arg[0] == '<')
+            redirect_index = IN;
+        if (arg[0] == '>')
+        {
+            if (len > 1 && arg[1] == '>')
+            {
+                redirect_index = APPEND;
+                arg++;
+                len--;
+            }
+            else
+                redirect_index = OUT;
+        }
+        if (redirect_index != -1)
+        {
+            legacy_redirects[redirect_index] = arena_strdup(&command_arena, arg + 1);
+            continue;
+        }
+
+        // normal arguments
+        if (len > 2 &&
+            ((arg[0] == '"' && arg[len - 1] == '"') ||
+             (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
+        {
+            arg[--len] = 0;
+            arg++;
+        }
+        command->args = arena_realloc(&command_arena, command->args,
+                                      sizeof(char *) * arg_index,
+                                      sizeof(char *) * (arg_index + 1));
+        command->args[arg_index++] = arena_strndup(&command_arena, arg, len);
+    }
+    command->arg_count = arg_index;
+    return 0;
+}
+
+/**
+ * Generate a script mixing plain commands, quoting, redirects and pipelines.
+ * Every token stays under the 1024 bytes the old parser can handle.
+ * @param  count number of lines
+ * @return       array of lines
+ */
+char **generate_script(int count)
+{
+    static const char *shapes[] = {
+        "ls -la /usr/lib/x86_64-linux-gnu/dir%d",
+        "grep -n --color=never \"pattern %d\" src/file%d.c > out%d.txt",
+        "cat access-%d.log | grep GET | uniq -c | sort -rn >> summary.txt",
+        "echo 'single quoted %d' \"double %d\" plain%d arg arg arg arg",
+        "find . -name '*.%d' -type f -newer ref%d -exec wc -l",
+        "make -j8 CFLAGS=-O2 target%d < input%d.txt &",
+    };
+    int nshapes = sizeof(shapes) / sizeof(shapes[0]);
+    char **lines = malloc(count * sizeof(char *));
+    for (int i = 0; i < count; i++)
+    {
+        char line[512];
+        snprintf(line, sizeof(line), shapes[i % nshapes], i, i, i);
+        lines[i] = strdup(line);
+    }
+    return lines;
+}
+
+/**
+ * Time one parser over the script, copying each line first since both parse
+ * destructively
+ * @return lines per second
+ */
+double run(int (*parse)(char *, struct command_t *), char **lines, int count,
+           int rounds)
+{
+    char buf[1024];
+    double start = now();
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            struct command_t *command =
+                arena_alloc(&command_arena, sizeof(struct command_t));
+            strcpy(buf, lines[i]);
+            parse(buf, command);
+            free_command(command);
+        }
+    }
+    return (double)count * rounds / (now() - start);
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    char **lines = generate_script(count);
+
+    run(parse_command, lines, count, 1); // warm up the arena
+    double lexer = run(parse_command, lines, count, rounds);
+    double legacy = run(legacy_parse_command, lines, count, rounds);
+    unsigned long heap_calls = command_arena.heap_calls;
+    run(parse_command, lines, count, 1);
+    printf("{\"bench\": \"parse\", \"revision\": \"%s\", \"lines\": %d, "
+           "\"lines_per_sec\": %.0f, \"legacy_lines_per_sec\": %.0f, "
+           "\"speedup\": %.2f, \"steady_state_heap_calls\": %lu}\n",
+           BENCH_REVISION, count, lexer, legacy, lexer / legacy,
+           command_arena.heap_calls - heap_calls);
+    return 0;
+}
@@ -0,0 +1,91 @@
+/**
+ * Pipeline throughput benchmark: pushes a file through pipelines of 1 to 8
+ * cat stages run by `shellax -c`, and reports MB/s for each length.
+ *
+ * make bench/pipeline_bench
+ * bench/pipeline_bench <shellax> [MB]
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bench.h"
+
+extern char **environ;
+
+/**
+ * Run one command line with the shell
+ * @return seconds, negative if the shell failed
+ */
+double run(const char *shell, const char *line)
+{
+    char *argv[] = {(char *)shell, "-c", (char *)line, NULL};
+    pid_t pid;
+    int status;
+    double start = now();
+    if (posix_spawn(&pid, shell, NULL, NULL, argv, environ) != 0 ||
+        waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <shellax> [MB]\n", argv[0]);
+        return 2;
+    }
+    const char *shell = argv[1];
+    int mb = argc > 2 ? atoi(argv[2]) : 256;
+
+    const char *tmpdir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/pipeline_bench.XXXXXX", tmpdir ? tmpdir : "/tmp");
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1)
+    {
+        perror(path);
+        return 1;
+    }
+    char block[1 << 16];
+    memset(block, 'x', sizeof(block));
+    for (int i = 0; i < mb * 16; i++)
+        if (write(fd, block, sizeof(block)) != sizeof(block))
+        {
+            perror(path);
+            unlink(path);
+            return 1;
+        }
+    close(fd);
+
+    static const int stages[] = {1, 2, 4, 8};
+    double rates[4];
+    for (int i = 0; i < 4; i++)
+    {
+        char line[8192];
+        int len = snprintf(line, sizeof(line), "cat %s", path);
+        for (int s = 1; s < stages[i]; s++)
+            len += snprintf(line + len, sizeof(line) - len, " | cat");
+        snprintf(line + len, sizeof(line) - len, " > /dev/null");
+        double elapsed = run(shell, line);
+        if (elapsed < 0)
+        {
+            fprintf(stderr, "pipeline_bench: %s -c '%s' failed\n", shell, line);
+            unlink(path);
+            return 1;
+        }
+        rates[i] = mb * 1.048576 / elapsed;
+    }
+    unlink(path);
+
+    printf("{\"bench\": \"pipeline\", \"revision\": \"%s\", \"mb\": %d", BENCH_REVISION, mb);
+    for (int i = 0; i < 4; i++)
+        printf(", \"stages_%d_mb_per_sec\": %.0f", stages[i], rates[i]);
+    printf("}\n");
+    return 0;
+}
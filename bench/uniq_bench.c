@@ -0,0 +1,63 @@
+/**
+ * uniq throughput benchmark: runs the uniq builtin over generated input with
+ * a given share of distinct lines, in memory and with a memory limit low
+ * enough to make it spill to disk.
+ *
+ * make bench/uniq_bench
+ * bench/uniq_bench [lines] [distinct]
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+#include <sys/mman.h>
+
+/**
+ * Run uniq once over the input
+ * @param  line    uniq command line
+ * @param  in_fd   input, rewound first
+ * @param  out_fd  [description]
+ * @return         seconds
+ */
+double run(const char *line, int in_fd, int out_fd)
+{
+    struct command_t *command = arena_alloc(&command_arena, sizeof(struct command_t));
+    parse_command(arena_strdup(&command_arena, line), command);
+    build_argv(command);
+    lseek(in_fd, 0, SEEK_SET);
+    double start = now();
+    if (builtin_uniq(command, in_fd, out_fd) != 0)
+    {
+        fprintf(stderr, "uniq_bench: %s failed\n", line);
+        exit(1);
+    }
+    double elapsed = now() - start;
+    free_command(command);
+    return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 2000000;
+    int distinct = argc > 2 ? atoi(argv[2]) : 200000;
+
+    int in_fd = memfd_create("uniq_bench", MFD_CLOEXEC);
+    FILE *in = fdopen(dup(in_fd), "w");
+    srand(1);
+    for (int i = 0; i < count; i++)
+        fprintf(in, "GET /static/asset-%d.js HTTP/1.1\n", rand() % distinct);
+    fclose(in);
+    double mb = lseek(in_fd, 0, SEEK_END) / 1e6;
+    int out_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    run("uniq", in_fd, out_fd); // warm up
+    double plain = run("uniq", in_fd, out_fd);
+    double counted = run("uniq -c", in_fd, out_fd);
+    double spilled = run("uniq -c --mem-limit=1M", in_fd, out_fd);
+
+    printf("{\"bench\": \"uniq\", \"revision\": \"%s\", \"lines\": %d, \"distinct\": %d, "
+           "\"mb\": %.1f, \"lines_per_sec\": %.0f, \"mb_per_sec\": %.1f, "
+           "\"count_lines_per_sec\": %.0f, \"spill_lines_per_sec\": %.0f}\n",
+           BENCH_REVISION, count, distinct, mb, count / plain, mb / plain,
+           count / counted, count / spilled);
+    return 0;
+}
@@ -1,104 +1,1744 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <dirent.h>
 #define BUFFSIZ 512
-int main(int argc, char *argv[])
+#define CHAT_LINGER_MS 5000 // to deliver what is queued after the end of input
+
+static double now()
 {
-    // check for enough arguments
-    if (argc < 3)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Members of the room the writer broadcasts to, each with its FIFO kept open.
+ * The room directory is watched with inotify: a FIFO being created or opened
+ * by its reader connects the member, its removal drops it. A member whose
+ * FIFO has no reader yet stays listed with fd -1 until it is opened. Opens
+ * are only watched while there is such a member, otherwise every member
+ * joining would wake everybody once for each FIFO it opens. When inotify is
+ * out of instances, the directory is scanned again whenever its mtime
+ * changes and unconnected members are retried on every message.
+ *
+ * Members are indexed by name and by fd, so an event costs the same however
+ * many members there are.
+ *
+ * Writes never block. What a member's FIFO can't take yet waits in a bounded
+ * queue of its own, flushed when epoll reports the FIFO writable; a queue
+ * that is full applies the room's policy, so a reader that stopped reading
+ * costs its own messages and never delays anybody else's.
+ */
+typedef enum
+{
+    QUEUE_DROP_OLDEST = 0,
+    QUEUE_DROP_NEWEST,
+    QUEUE_DISCONNECT,
+} QUEUE_POLICY;
+
+static const char *queue_policies[] = {"drop-oldest", "drop-newest", "disconnect"};
+
+/**
+ * Whole frames waiting for a FIFO, data[start, end)
+ */
+struct queue
+{
+    char *data; // allocated at the room's queue limit once first needed
+    size_t start, end;
+    int frames;
+};
+
+struct member
+{
+    char name[256];
+    int fd;         // write end of its FIFO, -1 while it has no reader
+    bool kicked;    // disconnected as too slow, until its FIFO is created anew;
+                    // the fd stays open until the notice telling it so is written
+    bool writable;  // not waiting for EPOLLOUT
+    struct queue queue;
+    uint64_t dropped;
+};
+
+#define ROOM_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct room
+{
+    char path[BUFFSIZ];
+    int inotify_fd;      // -1 when scanning instead
+    bool watching_opens; // IN_OPEN is watched too
+    int epoll_fd;        // full FIFOs are watched there
+    struct timespec mtime;
+    struct member *members;
+    int count, capacity;
+    int unconnected; // members with fd -1
+    // name -> member index + 1, open addressing with linear probing, 0 free
+    int *by_name;
+    int name_capacity;
+    // fd -> member index + 1, 0 for none
+    int *by_fd;
+    int fd_capacity;
+    QUEUE_POLICY policy;
+    size_t queue_limit; // bytes per member
+    uint64_t dropped, disconnected; // including members that left
+};
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+static int *room_name_slot(struct room *room, const char *name)
+{
+    int mask = room->name_capacity - 1;
+    int i = name_hash(name) & mask;
+    while (room->by_name[i] && strcmp(room->members[room->by_name[i] - 1].name, name) != 0)
+        i = (i + 1) & mask;
+    return &room->by_name[i];
+}
+
+/**
+ * Index the last member listed by its name
+ * @param room [description]
+ */
+static void room_name_insert(struct room *room)
+{
+    if (2 * room->count > room->name_capacity)
     {
-        fprintf(stderr, "usage: %s <roomname> <username>", argv[0]);
-        return 1;
+        free(room->by_name);
+        room->name_capacity = room->name_capacity ? 2 * room->name_capacity : 64;
+        room->by_name = calloc(room->name_capacity, sizeof(int));
+        for (int i = 0; i < room->count; i++)
+            *room_name_slot(room, room->members[i].name) = i + 1;
+        return;
     }
-    // create chatroom directory
-    char chatroom[BUFFSIZ];
-    sprintf(chatroom, "/tmp/chatroom-%s", argv[1]);
+    *room_name_slot(room, room->members[room->count - 1].name) = room->count;
+}
 
-    mkdir(chatroom, 0700);
-    
-    // create named pipe
-    char pipename[BUFFSIZ];
-    sprintf(pipename, "/tmp/chatroom-%s/%s", argv[1], argv[2]);
+static void room_name_remove(struct room *room, const char *name)
+{
+    int *slot = room_name_slot(room, name);
+    if (*slot == 0)
+        return;
+    *slot = 0;
+    // re-insert the rest of the cluster so lookups never stop early
+    int mask = room->name_capacity - 1;
+    for (int i = (slot - room->by_name + 1) & mask; room->by_name[i]; i = (i + 1) & mask)
+    {
+        int index = room->by_name[i];
+        room->by_name[i] = 0;
+        *room_name_slot(room, room->members[index - 1].name) = index;
+    }
+}
+
+/**
+ * Find a member by FIFO name
+ * @param  room [description]
+ * @param  name [description]
+ * @return      the member, NULL if it is not listed
+ */
+static struct member *room_find(struct room *room, const char *name)
+{
+    if (room->name_capacity == 0)
+        return NULL;
+    int index = *room_name_slot(room, name);
+    return index ? &room->members[index - 1] : NULL;
+}
+
+/**
+ * Watch the room directory for opens exactly while some member has no reader
+ * @param  room [description]
+ * @return      true if opens were not watched until now
+ */
+static bool room_watch(struct room *room)
+{
+    bool opens = room->unconnected > 0;
+    if (room->inotify_fd == -1 || opens == room->watching_opens)
+        return false;
+    // the same watch, its mask replaced
+    inotify_add_watch(room->inotify_fd, room->path, ROOM_EVENTS | (opens ? IN_OPEN : 0));
+    room->watching_opens = opens;
+    return opens;
+}
+
+/**
+ * Change the FIFO fd of a member, keeping the fd index up to date
+ * @param room   [description]
+ * @param member [description]
+ * @param fd     -1 once it is closed
+ */
+static void member_set_fd(struct room *room, struct member *member, int fd)
+{
+    if (member->fd != -1)
+        room->by_fd[member->fd] = 0;
+    else
+        room->unconnected--;
+    member->fd = fd;
+    if (fd == -1)
+        room->unconnected++;
+    else
+    {
+        if (fd >= room->fd_capacity)
+        {
+            int capacity = room->fd_capacity ? 2 * room->fd_capacity : 64;
+            while (capacity <= fd)
+                capacity *= 2;
+            room->by_fd = realloc(room->by_fd, capacity * sizeof(int));
+            memset(room->by_fd + room->fd_capacity, 0,
+                   (capacity - room->fd_capacity) * sizeof(int));
+            room->fd_capacity = capacity;
+        }
+        room->by_fd[fd] = member - room->members + 1;
+    }
+    room_watch(room);
+}
+
+/**
+ * Open the FIFO of a member if it is not open yet. Non-blocking, so a FIFO
+ * nobody reads fails with ENXIO instead of stalling the broadcast.
+ * @param room   [description]
+ * @param member [description]
+ */
+static void member_connect(struct room *room, struct member *member)
+{
+    if (member->fd != -1 || member->kicked)
+        return;
+    char path[BUFFSIZ + 256];
+    snprintf(path, sizeof(path), "%s/%s", room->path, member->name);
+    int fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    // opens were not watched, the reader may have come in before they were
+    if (fd == -1 && room_watch(room))
+        fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd != -1)
+        member_set_fd(room, member, fd);
+}
+
+/**
+ * Close a member's FIFO and forget what was queued for it
+ * @param room   [description]
+ * @param member [description]
+ */
+static void member_disconnect(struct room *room, struct member *member)
+{
+    if (member->fd != -1)
+    {
+        close(member->fd); // which takes it out of epoll too
+        member_set_fd(room, member, -1);
+    }
+    member->writable = true;
+    free(member->queue.data);
+    member->queue = (struct queue){NULL, 0, 0, 0};
+}
 
-    if (mkfifo(pipename, S_IRUSR | S_IWUSR) == -1)
+/**
+ * List a member, or reconnect one that is listed already
+ * @param room   [description]
+ * @param name   FIFO name in the room directory
+ * @param joined its FIFO was just created, a member kicked out gets another
+ *               chance
+ */
+static void room_add(struct room *room, const char *name, bool joined)
+{
+    if (name[0] == '.' || strlen(name) >= sizeof(room->members[0].name))
+        return;
+    struct member *member = room_find(room, name);
+    if (member == NULL)
+    {
+        if (room->count == room->capacity)
+        {
+            room->capacity = room->capacity ? 2 * room->capacity : 16;
+            room->members = realloc(room->members, room->capacity * sizeof(struct member));
+        }
+        member = &room->members[room->count++];
+        memset(member, 0, sizeof(*member));
+        strcpy(member->name, name);
+        member->fd = -1;
+        member->writable = true;
+        room->unconnected++;
+        room_name_insert(room);
+    }
+    if (joined)
+        member->kicked = false;
+    member_connect(room, member);
+}
+
+/**
+ * Drop a member that left the room
+ * @param room [description]
+ * @param name [description]
+ */
+static void room_remove(struct room *room, const char *name)
+{
+    struct member *member = room_find(room, name);
+    if (member == NULL)
+        return;
+    member_disconnect(room, member);
+    room->unconnected--;
+    room_name_remove(room, name);
+    struct member *last = &room->members[room->count - 1];
+    if (member != last)
+    {
+        // the last member moves into the gap, and so do its index entries
+        int index = member - room->members + 1;
+        *room_name_slot(room, last->name) = index;
+        if (last->fd != -1)
+            room->by_fd[last->fd] = index;
+        *member = *last;
+    }
+    room->count--;
+}
+
+/**
+ * List every member in the room directory and drop the ones that left
+ * @param  room [description]
+ * @return      0, -1 if the directory can not be read
+ */
+static int room_scan(struct room *room)
+{
+    DIR *dir = opendir(room->path);
+    if (dir == NULL)
+        return -1;
+    bool *seen = calloc(room->count + 1, sizeof(bool));
+    int known = room->count;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct member *member = room_find(room, entry->d_name);
+        if (member != NULL && member - room->members < known)
+            seen[member - room->members] = true;
+        room_add(room, entry->d_name, member == NULL);
+    }
+    closedir(dir);
+    // backwards, room_remove moves the last member into the gap
+    for (int i = known - 1; i >= 0; i--)
+        if (!seen[i])
+            room_remove(room, room->members[i].name);
+    free(seen);
+    return 0;
+}
+
+/**
+ * Watch the room directory, then list the members that are there already
+ * @param  room [description]
+ * @param  path room directory
+ * @return      0, -1 if the directory can not be read
+ */
+static int room_open(struct room *room, const char *path)
+{
+    QUEUE_POLICY policy = room->policy;
+    size_t queue_limit = room->queue_limit;
+    memset(room, 0, sizeof(*room));
+    room->policy = policy;
+    room->queue_limit = queue_limit;
+    room->epoll_fd = -1;
+    snprintf(room->path, sizeof(room->path), "%s", path);
+    // watching first, so nobody joins unnoticed between the two
+    room->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    room->watching_opens = true;
+    if (room->inotify_fd != -1 &&
+        inotify_add_watch(room->inotify_fd, path, ROOM_EVENTS | IN_OPEN) == -1)
+    {
+        close(room->inotify_fd);
+        room->inotify_fd = -1;
+    }
+    struct stat st;
+    if (stat(path, &st) == -1)
+        return -1;
+    room->mtime = st.st_mtim;
+    int r = room_scan(room);
+    room_watch(room);
+    return r;
+}
+
+/**
+ * Leave the room, closing every member's FIFO
+ * @param room [description]
+ */
+static void room_close(struct room *room)
+{
+    for (int i = 0; i < room->count; i++)
+        member_disconnect(room, &room->members[i]);
+    free(room->members);
+    free(room->by_name);
+    free(room->by_fd);
+    room->members = NULL;
+    room->by_name = room->by_fd = NULL;
+    room->count = room->capacity = room->name_capacity = room->fd_capacity = 0;
+    room->unconnected = 0;
+    if (room->inotify_fd != -1)
+        close(room->inotify_fd);
+    room->inotify_fd = -1;
+}
+
+/**
+ * Apply the joins and leaves inotify reported since the last call
+ * @param room [description]
+ */
+static void room_update(struct room *room)
+{
+    if (room->inotify_fd == -1)
+    {
+        struct stat st;
+        if (stat(room->path, &st) == 0 && (st.st_mtim.tv_sec != room->mtime.tv_sec ||
+                                           st.st_mtim.tv_nsec != room->mtime.tv_nsec))
+        {
+            room->mtime = st.st_mtim;
+            room_scan(room);
+        }
+        return;
+    }
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(room->inotify_fd, events, sizeof(events))) > 0)
+    {
+        for (char *p = events; p < events + len;)
+        {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0)
+                continue;
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                room_remove(room, event->name);
+            else
+                room_add(room, event->name, event->mask & (IN_CREATE | IN_MOVED_TO));
+        }
+    }
+}
+
+/**
+ * Wire format of both transports. Every message is a frame: a fixed header
+ * and len bytes of "user:text". No frame is larger than FRAME_MAX; a longer
+ * message goes in several, and those after the first are flagged
+ * FRAME_CONTINUED and carry only text, so it is printed with one prefix.
+ * A writer that disconnects a slow reader sends it a FRAME_KICKED frame last,
+ * and the reader joins again.
+ * Writers batch whole messages into writes of at most PIPE_BUF, which a FIFO
+ * takes in one piece, so frames of concurrent writers never interleave.
+ */
+#define FRAME_MAX 1024
+#define FRAME_CONTINUED 1 // carries on the message of the frame before it
+#define FRAME_KICKED 2    // no payload, its writer disconnected the reader as too slow
+
+struct frame_header
+{
+    uint16_t len;       // payload bytes after the header
+    uint16_t flags;     // FRAME_CONTINUED
+    uint32_t sender;    // pid of the sending member
+    uint64_t seq;       // counted by each sender from 0
+    uint64_t timestamp; // CLOCK_REALTIME nanoseconds at sending
+};
+
+#define FRAME_PAYLOAD_MAX (FRAME_MAX - sizeof(struct frame_header))
+
+/**
+ * Frames waiting to be sent, each as four iovecs: header, user name, ':' and
+ * the text, which is not copied out of the outbox it was typed into. The
+ * name and ':' are empty in a frame that continues a message.
+ */
+#define BATCH_FRAMES (PIPE_BUF / (sizeof(struct frame_header) + 1))
+
+struct batch
+{
+    struct frame_header headers[BATCH_FRAMES];
+    struct iovec iov[4 * BATCH_FRAMES];
+    int frames;
+    size_t bytes; // at most PIPE_BUF
+};
+
+/**
+ * Add a frame to a batch
+ * @param  batch     [description]
+ * @param  header    len is filled in here
+ * @param  username  NULL for a frame that continues a message
+ * @param  text      must stay valid until the batch is sent
+ * @param  len       bytes of text, the payload must fit FRAME_PAYLOAD_MAX
+ * @return           0, -1 if the batch has no room for it
+ */
+static int batch_add(struct batch *batch, struct frame_header header, const char *username,
+                     const char *text, size_t len)
+{
+    size_t user_len = username ? strlen(username) : 0;
+    header.len = (username ? user_len + 1 : 0) + len;
+    if (batch->frames == BATCH_FRAMES ||
+        batch->bytes + sizeof(header) + header.len > PIPE_BUF)
+        return -1;
+    batch->headers[batch->frames] = header;
+    struct iovec *iov = &batch->iov[4 * batch->frames];
+    iov[0] = (struct iovec){&batch->headers[batch->frames], sizeof(header)};
+    iov[1] = (struct iovec){(char *)username, user_len};
+    iov[2] = (struct iovec){":", username ? 1 : 0};
+    iov[3] = (struct iovec){(char *)text, len};
+    batch->frames++;
+    batch->bytes += sizeof(header) + header.len;
+    return 0;
+}
+
+/**
+ * Copy one frame of a batch into a buffer
+ * @param  batch [description]
+ * @param  i     frame index
+ * @param  frame at least FRAME_MAX bytes
+ * @return       frame size
+ */
+static size_t batch_copy(const struct batch *batch, int i, char *frame)
+{
+    size_t len = 0;
+    for (int j = 4 * i; j < 4 * i + 4; j++)
+    {
+        memcpy(frame + len, batch->iov[j].iov_base, batch->iov[j].iov_len);
+        len += batch->iov[j].iov_len;
+    }
+    return len;
+}
+
+/**
+ * Print the message, or the piece of one, a frame carries
+ * @param  frame  [description]
+ * @param  len    bytes available
+ * @param  resync set by a reader that may be in the middle of a message, the
+ *                rest of it is skipped and this cleared at the next one. NULL
+ *                for one that never is.
+ * @return        size of the frame, 0 if it is incomplete, -1 if it is corrupt
+ */
+static ssize_t frame_print(const char *frame, size_t len, bool *resync)
+{
+    struct frame_header header;
+    if (len < sizeof(header))
+        return 0;
+    memcpy(&header, frame, sizeof(header)); // the buffer may be unaligned
+    if (header.len > FRAME_PAYLOAD_MAX)
+        return -1;
+    if (len < sizeof(header) + header.len)
+        return 0;
+    if (resync && *resync && (header.flags & FRAME_CONTINUED))
+        return sizeof(header) + header.len;
+    if (resync)
+        *resync = false;
+    fwrite(frame + sizeof(header), 1, header.len, stdout);
+    return sizeof(header) + header.len;
+}
+
+static uint16_t frame_flags(const char *frame)
+{
+    struct frame_header header;
+    memcpy(&header, frame, sizeof(header));
+    return header.flags;
+}
+
+/**
+ * The user's own FIFO, opened read-write and non-blocking, so it never
+ * reports EOF when writers come and go. One read may return several frames,
+ * and the last one may be incomplete; it is kept until the rest arrives.
+ */
+struct inbox
+{
+    int fd;
+    char data[2 * PIPE_BUF];
+    size_t len;
+    bool kicked; // a writer stopped writing to it, the FIFO is created anew
+};
+
+/**
+ * Create the user's FIFO unless it is there and open it
+ * @param  inbox [description]
+ * @param  path  [description]
+ * @return       the fd, -1 on failure
+ */
+static int inbox_open(struct inbox *inbox, const char *path)
+{
+    if (mkfifo(path, S_IRUSR | S_IWUSR) == -1 && errno != EEXIST)
     {
         perror("Error piping!");
     }
-    // process for writing, since every named process has own writing process
-    pid_t pid_write = fork();
-    int fd_write;
-    char message[BUFFSIZ];
+    inbox->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    inbox->len = 0;
+    inbox->kicked = false;
+    return inbox->fd;
+}
 
-    if (pid_write == 0)
+/**
+ * Print every complete message the FIFO holds
+ * @param  inbox [description]
+ * @return       0, -1 on a read error
+ */
+static int inbox_drain(struct inbox *inbox)
+{
+    ssize_t n;
+    while ((n = read(inbox->fd, inbox->data + inbox->len, sizeof(inbox->data) - inbox->len)) > 0)
     {
-        while (1)
+        inbox->len += n;
+        char *m = inbox->data, *end = inbox->data + inbox->len;
+        ssize_t size;
+        while ((size = frame_print(m, end - m, NULL)) > 0)
+        {
+            if (frame_flags(m) & FRAME_KICKED)
+                inbox->kicked = true;
+            m += size;
+        }
+        if (size == -1)
         {
-            // take message from stdin
-            printf("Your Message:");
-            fflush(stdout);
-            fgets(message, BUFFSIZ, stdin);
-            // open the directory and iterate over all named pipes
-            struct dirent *dir;
-            DIR *chatroom_dir = opendir(chatroom);
+            // somebody wrote to the FIFO who does not speak frames
+            fprintf(stderr, "[%zu bytes of garbage dropped]\n", (size_t)(end - m));
+            m = end;
+        }
+        inbox->len = end - m;
+        memmove(inbox->data, m, inbox->len);
+    }
+    fflush(stdout); // stdout may be a pipe
+    return n == -1 && errno != EAGAIN && errno != EINTR ? -1 : 0;
+}
 
-            while ((dir = readdir(chatroom_dir)) != NULL)
-            {
+/**
+ * Size of a queued frame
+ * @param  frame [description]
+ * @return       [description]
+ */
+static size_t frame_size(const char *frame)
+{
+    struct frame_header header;
+    memcpy(&header, frame, sizeof(header));
+    return sizeof(header) + header.len;
+}
 
-                if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, ".."))
+/**
+ * Queue the frames of a batch for a member, applying the room's policy to
+ * the messages that don't fit. A message is queued or dropped whole.
+ * @param room   [description]
+ * @param member [description]
+ * @param batch  [description]
+ * @param first  frames before it were written already
+ */
+static void queue_push(struct room *room, struct member *member, const struct batch *batch,
+                       int first)
+{
+    struct queue *queue = &member->queue;
+    if (queue->data == NULL && (queue->data = malloc(room->queue_limit)) == NULL)
+        return;
+    for (int i = first, n; i < batch->frames; i += n)
+    {
+        size_t len = sizeof(struct frame_header) + batch->headers[i].len;
+        for (n = 1; i + n < batch->frames && (batch->headers[i + n].flags & FRAME_CONTINUED); n++)
+            len += sizeof(struct frame_header) + batch->headers[i + n].len;
+        if (len > room->queue_limit)
+            continue;
+        if (queue->end - queue->start + len > room->queue_limit)
+        {
+            if (room->policy == QUEUE_DISCONNECT)
+            {
+                member->dropped += queue->frames + batch->frames - i;
+                room->dropped += queue->frames + batch->frames - i;
+                room->disconnected++;
+                member->kicked = true;
+                // all that is left for it is the notice, written once it reads
+                struct frame_header notice = {.flags = FRAME_KICKED};
+                memcpy(queue->data, &notice, sizeof(notice));
+                queue->start = 0;
+                queue->end = sizeof(notice);
+                queue->frames = 1;
+                return;
+            }
+            if (room->policy == QUEUE_DROP_NEWEST)
+            {
+                member->dropped += n;
+                room->dropped += n;
+                continue;
+            }
+            while (queue->end - queue->start + len > room->queue_limit)
+            {
+                do
                 {
-                    continue;
-                }
+                    queue->start += frame_size(queue->data + queue->start);
+                    queue->frames--;
+                    member->dropped++;
+                    room->dropped++;
+                } while (queue->frames > 0 && (frame_flags(queue->data + queue->start) & FRAME_CONTINUED));
+            }
+        }
+        if (queue->end + len > room->queue_limit)
+        {
+            memmove(queue->data, queue->data + queue->start, queue->end - queue->start);
+            queue->end -= queue->start;
+            queue->start = 0;
+        }
+        for (int j = i; j < i + n; j++)
+            queue->end += batch_copy(batch, j, queue->data + queue->end);
+        queue->frames += n;
+    }
+}
 
-                char directory[2048];
+/**
+ * Write what is queued for a member, whole messages up to PIPE_BUF at a time
+ * so every write is all or nothing and no other writer's message lands
+ * inside one, and watch its FIFO for room if some is left
+ * @param room   [description]
+ * @param member [description]
+ */
+static void member_flush(struct room *room, struct member *member)
+{
+    struct queue *queue = &member->queue;
+    while (member->fd != -1 && queue->frames > 0)
+    {
+        size_t len = 0, whole = 0, next;
+        int frames = 0, whole_frames = 0;
+        while (frames < queue->frames &&
+               len + (next = frame_size(queue->data + queue->start + len)) <= PIPE_BUF)
+        {
+            len += next;
+            frames++;
+            if (frames == queue->frames || !(frame_flags(queue->data + queue->start + len) & FRAME_CONTINUED))
+            {
+                whole = len;
+                whole_frames = frames;
+            }
+        }
+        len = whole;
+        frames = whole_frames;
+        if (write(member->fd, queue->data + queue->start, len) == -1)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                break;
+            if (errno != EPIPE)
+                perror("Error in writing");
+            member_disconnect(room, member);
+            return;
+        }
+        queue->start += len;
+        queue->frames -= frames;
+    }
+    if (queue->frames == 0)
+        queue->start = queue->end = 0;
+    // a member kicked out got its notice, that was the last write
+    if (member->kicked && queue->frames == 0)
+    {
+        member_disconnect(room, member);
+        return;
+    }
+    bool writable = queue->frames == 0;
+    if (member->fd != -1 && writable != member->writable && room->epoll_fd != -1)
+    {
+        struct epoll_event event = {.events = EPOLLOUT, .data.fd = member->fd};
+        epoll_ctl(room->epoll_fd, writable ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, member->fd, &event);
+        member->writable = writable;
+    }
+}
 
-                sprintf(directory, "%s/%s", chatroom, dir->d_name);
+/**
+ * Flush the member whose FIFO epoll reported writable
+ * @param room [description]
+ * @param fd   [description]
+ * @return     0, -1 if no member has that fd
+ */
+static int room_writable(struct room *room, int fd)
+{
+    if (fd < 0 || fd >= room->fd_capacity || room->by_fd[fd] == 0)
+        return -1;
+    member_flush(room, &room->members[room->by_fd[fd] - 1]);
+    return 0;
+}
 
-                char new_message[2048];
-                sprintf(new_message, "%s:%s", argv[2], message);
-                // open named pipe for writing
-                fd_write = open(directory, O_WRONLY);
-                if ((write(fd_write, new_message, strlen(new_message) + 1)) == -1)
-                {
+/**
+ * Bytes queued for all the members
+ * @param  room [description]
+ * @return      [description]
+ */
+static size_t room_queued(const struct room *room)
+{
+    size_t queued = 0;
+    for (int i = 0; i < room->count; i++)
+        queued += room->members[i].queue.end - room->members[i].queue.start;
+    return queued;
+}
+
+/**
+ * Send a batch to every member with one writev each. A member whose reader
+ * went away is closed and reconnected when its FIFO is opened again. A full
+ * FIFO, or one with frames queued already, gets the batch queued.
+ * @param room  [description]
+ * @param batch at most PIPE_BUF bytes, so a writev is all or nothing
+ */
+static void room_broadcast(struct room *room, const struct batch *batch)
+{
+    for (int i = 0; i < room->count; i++)
+    {
+        struct member *member = &room->members[i];
+        if (member->kicked)
+        {
+            // until it joins again
+            member->dropped += batch->frames;
+            room->dropped += batch->frames;
+            continue;
+        }
+        if (room->inotify_fd == -1)
+            member_connect(room, member);
+        if (member->fd == -1)
+            continue;
+        if (member->queue.frames == 0)
+        {
+            if (writev(member->fd, batch->iov, 4 * batch->frames) != -1)
+                continue;
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                if (errno != EPIPE)
                     perror("Error in writing");
+                member_disconnect(room, member);
+                continue;
+            }
+        }
+        queue_push(room, member, batch, 0);
+        member_flush(room, member);
+    }
+}
+
+/**
+ * Shared memory transport, chatroom -t shm. Every room has one segment,
+ * /dev/shm/chatroom-<room>, holding a broadcast ring of fixed-size slots.
+ * A writer claims a position with one atomic add and publishes the slot by
+ * storing position + 1 in its seq; every reader follows with a cursor of its
+ * own, so the sender does the same work however many readers there are.
+ * Sleeping readers wait on a futex the writer bumps after each message, and
+ * it is only woken when somebody sleeps. A reader that falls more than the
+ * ring behind loses the messages that were overwritten.
+ *
+ * Every member holds a shared flock on the segment while it is in the room.
+ * The one leaving that can take it exclusively is the last and unlinks the
+ * segment; one that crashed released its lock with its fds.
+ */
+#define RING_SLOTS 4096 // power of two
+
+struct ring_slot
+{
+    _Atomic uint64_t seq; // position + 1 once published, 0 while written
+    uint32_t len;
+    char data[FRAME_MAX]; // one frame
+};
+
+struct ring
+{
+    _Atomic uint64_t head;    // next position a writer claims
+    _Atomic uint32_t futex;   // bumped after every message
+    _Atomic uint32_t waiters; // readers asleep on futex
+    char pad[48];             // the slots don't share the header's cache line
+    struct ring_slot slots[RING_SLOTS];
+};
+
+struct ring_reader
+{
+    struct ring *ring;
+    uint64_t cursor;   // next position to read
+    atomic_bool stop;
+    _Atomic uint64_t lost;
+    pthread_t thread;
+};
+
+static long futex(_Atomic uint32_t *word, int op, uint32_t value)
+{
+    return syscall(SYS_futex, (uint32_t *)word, op, value, NULL, NULL, 0);
+}
+
+/**
+ * Map the ring of a room, creating it if this is the first member. A new
+ * segment is all zeros, which is an empty ring.
+ * @param  room room name
+ * @param  fd   set to the segment, locked shared until ring_close
+ * @return      the ring, NULL on failure
+ */
+static struct ring *ring_open(const char *room, int *fd)
+{
+    char name[BUFFSIZ];
+    snprintf(name, sizeof(name), "/chatroom-%s", room);
+    struct stat st;
+    while (1)
+    {
+        *fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (*fd == -1)
+            return NULL;
+        if (flock(*fd, LOCK_SH) == -1 || fstat(*fd, &st) == -1)
+        {
+            close(*fd);
+            return NULL;
+        }
+        // the last member unlinked it while we waited for the lock
+        if (st.st_nlink > 0)
+            break;
+        close(*fd);
+    }
+    if (st.st_size < (off_t)sizeof(struct ring) && ftruncate(*fd, sizeof(struct ring)) == -1)
+    {
+        close(*fd);
+        return NULL;
+    }
+    struct ring *ring = mmap(NULL, sizeof(struct ring), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (ring == MAP_FAILED)
+    {
+        close(*fd);
+        return NULL;
+    }
+    return ring;
+}
+
+/**
+ * Unmap the ring of a room, and remove it if nobody else is in the room
+ * @param ring [description]
+ * @param fd   from ring_open
+ * @param room room name
+ */
+static void ring_close(struct ring *ring, int fd, const char *room)
+{
+    munmap(ring, sizeof(struct ring));
+    // fails while another member holds its shared lock
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+    {
+        char name[BUFFSIZ];
+        snprintf(name, sizeof(name), "/chatroom-%s", room);
+        shm_unlink(name);
+    }
+    close(fd);
+}
+
+/**
+ * Publish a batch to every reader of the ring, a slot per frame claimed all
+ * at once, and wake the readers once for all of them
+ * @param ring  [description]
+ * @param batch [description]
+ */
+static void ring_publish(struct ring *ring, const struct batch *batch)
+{
+    uint64_t pos = atomic_fetch_add(&ring->head, batch->frames);
+    for (int i = 0; i < batch->frames; i++, pos++)
+    {
+        struct ring_slot *slot = &ring->slots[pos & (RING_SLOTS - 1)];
+        atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        slot->len = batch_copy(batch, i, slot->data);
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    }
+
+    atomic_fetch_add(&ring->futex, 1);
+    if (atomic_load(&ring->waiters) > 0)
+        futex(&ring->futex, FUTEX_WAKE, INT_MAX);
+}
+
+/**
+ * Copy the message at the reader's cursor
+ * @param  reader  [description]
+ * @param  message at least FRAME_MAX bytes
+ * @param  len     set to the message length
+ * @return         1 for a message, 0 if there is none yet, -1 if messages
+ *                 were overwritten before they were read (the cursor skips
+ *                 them)
+ */
+static int ring_read(struct ring_reader *reader, char *message, size_t *len)
+{
+    struct ring *ring = reader->ring;
+    struct ring_slot *slot = &ring->slots[reader->cursor & (RING_SLOTS - 1)];
+    uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq == reader->cursor + 1)
+    {
+        *len = slot->len < sizeof(slot->data) ? slot->len : sizeof(slot->data);
+        memcpy(message, slot->data, *len);
+        // a writer a whole ring ahead may have reused the slot meanwhile
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq)
+        {
+            reader->cursor++;
+            return 1;
+        }
+    }
+    uint64_t head = atomic_load(&ring->head);
+    if (head > reader->cursor + RING_SLOTS || seq > reader->cursor + 1)
+    {
+        uint64_t oldest = head > RING_SLOTS ? head - RING_SLOTS : 0;
+        uint64_t lost = oldest > reader->cursor ? oldest - reader->cursor : 1;
+        fprintf(stderr, "[%llu messages lost]\n", (unsigned long long)lost);
+        atomic_fetch_add(&reader->lost, lost);
+        reader->cursor = oldest > reader->cursor ? oldest : reader->cursor + 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void *ring_reader_thread(void *arg)
+{
+    struct ring_reader *reader = arg;
+    struct ring *ring = reader->ring;
+    char message[FRAME_MAX];
+    size_t len;
+    bool resync = false; // the head is where a batch starts
+    while (!atomic_load(&reader->stop))
+    {
+        int r = ring_read(reader, message, &len);
+        if (r == 1)
+        {
+            if (frame_print(message, len, &resync) <= 0)
+                fprintf(stderr, "[corrupt frame dropped]\n");
+            continue;
+        }
+        if (r == -1)
+        {
+            resync = true; // what was lost may have begun a message
+            continue;
+        }
+        fflush(stdout); // stdout may be a pipe
+        // announce the sleep before the last look, so a message published
+        // after it always wakes us
+        atomic_fetch_add(&ring->waiters, 1);
+        uint32_t value = atomic_load(&ring->futex);
+        struct ring_slot *slot = &ring->slots[reader->cursor & (RING_SLOTS - 1)];
+        if (atomic_load(&slot->seq) != reader->cursor + 1 && !atomic_load(&reader->stop))
+            futex(&ring->futex, FUTEX_WAIT, value);
+        atomic_fetch_sub(&ring->waiters, 1);
+    }
+    return NULL;
+}
+
+/**
+ * Follow the ring on a thread of its own
+ * @param  reader [description]
+ * @param  ring   [description]
+ * @param  cursor first position to read, the ring's head when joining
+ * @return        0, an errno value on failure
+ */
+static int ring_reader_start(struct ring_reader *reader, struct ring *ring, uint64_t cursor)
+{
+    reader->ring = ring;
+    reader->cursor = cursor;
+    atomic_store(&reader->stop, false);
+    return pthread_create(&reader->thread, NULL, ring_reader_thread, reader);
+}
+
+static void ring_reader_stop(struct ring_reader *reader)
+{
+    atomic_store(&reader->stop, true);
+    // wakes the other readers of the room too, they go back to sleep
+    atomic_fetch_add(&reader->ring->futex, 1);
+    futex(&reader->ring->futex, FUTEX_WAKE, INT_MAX);
+    pthread_join(reader->thread, NULL);
+}
+
+/**
+ * Message log of a room, so members who join late can catch up. Every sender
+ * appends its own frames to the room's .log directory, which room_add skips,
+ * before broadcasting them. The log is a series of segments of
+ * LOG_SEGMENT_MESSAGES frames each, numbered from 0: <n>.log holds the frames
+ * back to back and <n>.idx, mapped by every writer, the offset and append
+ * time of each, so a message is found by its room sequence number directly
+ * and by time with a binary search. Starting segment n deletes segment
+ * n - LOG_SEGMENTS, which bounds the log to LOG_SEGMENTS * LOG_SEGMENT_MESSAGES
+ * frames. Appends hold an exclusive flock on .log/control, which maps the
+ * sequence number of the next message; readers replay from mapped segments
+ * without taking part in any broadcast.
+ */
+#define LOG_SEGMENT_MESSAGES 1024
+#define LOG_SEGMENTS 8 // at most 8 MiB of frames
+
+struct log_control
+{
+    uint64_t next_seq;
+};
+
+struct log_entry
+{
+    uint64_t offset;    // in the segment's .log
+    uint64_t timestamp; // CLOCK_REALTIME nanoseconds of the append
+};
+
+struct log_index
+{
+    uint64_t count; // entries in use
+    uint64_t size;  // bytes in use of the segment's .log
+    struct log_entry entries[LOG_SEGMENT_MESSAGES];
+};
+
+struct chat_log
+{
+    char path[BUFFSIZ + 8];
+    int control_fd; // -1 when the room has no log
+    struct log_control *control;
+    uint64_t segment; // the one mapped for appending
+    int data_fd;      // -1 when none is
+    struct log_index *index;
+};
+
+/**
+ * A segment mapped for reading
+ */
+struct log_segment
+{
+    const struct log_index *index;
+    const char *data;
+    size_t size;
+};
+
+/**
+ * Open the log of a room, creating it if needed
+ * @param  log  [description]
+ * @param  room room directory
+ * @return      0, -1 on failure, the room then goes without a log
+ */
+static int log_open(struct chat_log *log, const char *room)
+{
+    char path[sizeof(log->path) + 16];
+    snprintf(log->path, sizeof(log->path), "%s/.log", room);
+    snprintf(path, sizeof(path), "%s/control", log->path);
+    log->data_fd = -1;
+    mkdir(log->path, 0700);
+    log->control_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (log->control_fd == -1)
+        return -1;
+    // zero filled, next_seq starts at 0
+    if (ftruncate(log->control_fd, sizeof(struct log_control)) == -1 ||
+        (log->control = mmap(NULL, sizeof(struct log_control), PROT_READ | PROT_WRITE,
+                             MAP_SHARED, log->control_fd, 0)) == MAP_FAILED)
+    {
+        close(log->control_fd);
+        log->control_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Map a segment for appending, with the control lock held
+ * @param  log     [description]
+ * @param  segment [description]
+ * @param  fresh   its first message is next, start it over and rotate
+ * @return         0, -1 on failure
+ */
+static int log_map_for_append(struct chat_log *log, uint64_t segment, bool fresh)
+{
+    if (log->data_fd != -1 && log->segment == segment && !fresh)
+        return 0;
+    if (log->data_fd != -1)
+    {
+        munmap(log->index, sizeof(struct log_index));
+        close(log->data_fd);
+        log->data_fd = -1;
+    }
+    char path[sizeof(log->path) + 32];
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC | (fresh ? O_TRUNC : 0);
+    if (fresh && segment >= LOG_SEGMENTS)
+    {
+        snprintf(path, sizeof(path), "%s/%llu.log", log->path,
+                 (unsigned long long)(segment - LOG_SEGMENTS));
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/%llu.idx", log->path,
+                 (unsigned long long)(segment - LOG_SEGMENTS));
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/%llu.idx", log->path, (unsigned long long)segment);
+    int index_fd = open(path, flags, 0600);
+    if (index_fd == -1)
+        return -1;
+    if (ftruncate(index_fd, sizeof(struct log_index)) == -1 ||
+        (log->index = mmap(NULL, sizeof(struct log_index), PROT_READ | PROT_WRITE, MAP_SHARED,
+                           index_fd, 0)) == MAP_FAILED)
+    {
+        close(index_fd);
+        return -1;
+    }
+    close(index_fd);
+    snprintf(path, sizeof(path), "%s/%llu.log", log->path, (unsigned long long)segment);
+    log->data_fd = open(path, flags, 0600);
+    if (log->data_fd == -1)
+    {
+        munmap(log->index, sizeof(struct log_index));
+        return -1;
+    }
+    log->segment = segment;
+    return 0;
+}
+
+/**
+ * Append the frames of a batch to the log
+ * @param log   [description]
+ * @param batch [description]
+ */
+static void log_append(struct chat_log *log, const struct batch *batch)
+{
+    if (log->control_fd == -1 || flock(log->control_fd, LOCK_EX) == -1)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t timestamp = now.tv_sec * 1000000000ull + now.tv_nsec;
+    // one write for the frames that go to the same segment
+    for (int i = 0, n; i < batch->frames; i += n)
+    {
+        uint64_t seq = log->control->next_seq;
+        uint64_t entry = seq % LOG_SEGMENT_MESSAGES;
+        if (log_map_for_append(log, seq / LOG_SEGMENT_MESSAGES, entry == 0) == -1)
+            break;
+        struct log_index *index = log->index;
+        n = batch->frames - i;
+        if (n > LOG_SEGMENT_MESSAGES - entry)
+            n = LOG_SEGMENT_MESSAGES - entry;
+        size_t len = 0;
+        for (int j = i; j < i + n; j++)
+            len += sizeof(struct frame_header) + batch->headers[j].len;
+        // the index is what counts, frames half written are overwritten later
+        if (pwritev(log->data_fd, &batch->iov[4 * i], 4 * n, index->size) != (ssize_t)len)
+            break;
+        for (int j = i; j < i + n; j++, entry++)
+        {
+            index->entries[entry] = (struct log_entry){index->size, timestamp};
+            index->size += sizeof(struct frame_header) + batch->headers[j].len;
+        }
+        index->count = entry;
+        log->control->next_seq = seq + n;
+    }
+    flock(log->control_fd, LOCK_UN);
+}
+
+/**
+ * Map a segment for reading
+ * @param  log     [description]
+ * @param  segment [description]
+ * @param  map     [description]
+ * @return         0, -1 if it is gone
+ */
+static int log_segment_map(const struct chat_log *log, uint64_t segment, struct log_segment *map)
+{
+    char path[sizeof(log->path) + 32];
+    snprintf(path, sizeof(path), "%s/%llu.idx", log->path, (unsigned long long)segment);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    map->index = mmap(NULL, sizeof(struct log_index), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map->index == MAP_FAILED)
+        return -1;
+    snprintf(path, sizeof(path), "%s/%llu.log", log->path, (unsigned long long)segment);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    map->size = fd != -1 && fstat(fd, &st) == 0 ? st.st_size : 0;
+    map->data = map->size ? mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (fd != -1)
+        close(fd);
+    if (map->data == MAP_FAILED)
+    {
+        munmap((void *)map->index, sizeof(struct log_index));
+        return -1;
+    }
+    return 0;
+}
+
+static void log_segment_unmap(struct log_segment *map)
+{
+    munmap((void *)map->index, sizeof(struct log_index));
+    munmap((void *)map->data, map->size);
+}
+
+/**
+ * First entry of a segment appended at or after a time
+ * @param  index     [description]
+ * @param  count     entries to search
+ * @param  timestamp CLOCK_REALTIME nanoseconds
+ * @return           count if there is none
+ */
+static uint64_t log_index_search(const struct log_index *index, uint64_t count,
+                                 uint64_t timestamp)
+{
+    uint64_t low = 0, high = count;
+    while (low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if (index->entries[mid].timestamp < timestamp)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/**
+ * Print the messages logged so far, the last few or those since a time
+ * @param log   [description]
+ * @param last  at most that many, 0 for no limit
+ * @param since CLOCK_REALTIME nanoseconds, 0 for no limit
+ */
+static void log_replay(struct chat_log *log, uint64_t last, uint64_t since)
+{
+    if (log->control_fd == -1 || flock(log->control_fd, LOCK_SH) == -1)
+        return;
+    uint64_t end = log->control->next_seq;
+    flock(log->control_fd, LOCK_UN);
+    if (end == 0)
+        return;
+    // segments are never rewritten under the same number, a snapshot of the
+    // end is all the locking reading needs
+    uint64_t newest = (end - 1) / LOG_SEGMENT_MESSAGES;
+    uint64_t seq = newest >= LOG_SEGMENTS ? (newest - LOG_SEGMENTS + 1) * LOG_SEGMENT_MESSAGES : 0;
+    if (last != 0 && end - seq > last)
+        seq = end - last;
+    // neither a count nor a time need to start where a message does
+    bool resync = true;
+    while (seq < end)
+    {
+        uint64_t segment = seq / LOG_SEGMENT_MESSAGES;
+        uint64_t segment_end = (segment + 1) * LOG_SEGMENT_MESSAGES;
+        struct log_segment map;
+        if (log_segment_map(log, segment, &map) == -1)
+        {
+            seq = segment_end; // rotated away meanwhile
+            resync = true;
+            continue;
+        }
+        uint64_t count = (end < segment_end ? end : segment_end) - segment * LOG_SEGMENT_MESSAGES;
+        uint64_t entry = seq % LOG_SEGMENT_MESSAGES;
+        if (since != 0)
+        {
+            uint64_t first = log_index_search(map.index, count, since);
+            if (first > entry)
+                entry = first;
+        }
+        for (; entry < count; entry++)
+        {
+            uint64_t offset = map.index->entries[entry].offset;
+            if (offset >= map.size ||
+                frame_print(map.data + offset, map.size - offset, &resync) <= 0)
+                break;
+        }
+        log_segment_unmap(&map);
+        seq = segment_end;
+    }
+    fflush(stdout);
+}
+
+/**
+ * Parse a replay start: seconds since the epoch, or a time ago with a unit,
+ * like 90s, 15m, 2h or 1d
+ * @param  arg [description]
+ * @return     CLOCK_REALTIME nanoseconds, 0 if it is not a time
+ */
+static uint64_t parse_since(const char *arg)
+{
+    char *unit;
+    double value = strtod(arg, &unit);
+    if (unit == arg || value < 0)
+        return 0;
+    const char *units = "smhd";
+    double seconds[] = {1, 60, 3600, 86400};
+    if (*unit == 0)
+        return value * 1e9;
+    const char *u = unit[1] == 0 ? strchr(units, *unit) : NULL;
+    if (u == NULL)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    double ago = now.tv_sec + now.tv_nsec / 1e9 - value * seconds[u - units];
+    return ago > 0 ? ago * 1e9 : 1;
+}
+
+typedef enum
+{
+    TRANSPORT_FIFO = 0,
+    TRANSPORT_SHM,
+} TRANSPORT;
+
+/**
+ * A user's session: the transport messages go out and come in through
+ */
+struct chat
+{
+    TRANSPORT transport;
+    const char *username;
+    uint32_t sender; // frame header fields
+    uint64_t seq;
+    struct room room; // FIFO transport
+    struct inbox inbox;
+    struct ring *ring; // shared memory transport
+    int ring_fd;
+    struct ring_reader reader;
+    struct chat_log log;
+};
+
+/**
+ * Send a batch to everybody in the room, the sender included, and empty it
+ * @param chat  [description]
+ * @param batch [description]
+ */
+static void chat_send(struct chat *chat, struct batch *batch)
+{
+    if (batch->frames == 0)
+        return;
+    log_append(&chat->log, batch);
+    if (chat->transport == TRANSPORT_SHM)
+        ring_publish(chat->ring, batch);
+    else
+        room_broadcast(&chat->room, batch);
+    batch->frames = 0;
+    batch->bytes = 0;
+}
+
+/**
+ * /metrics: what is waiting to be delivered and what was given up on
+ * @param chat [description]
+ */
+static void chat_metrics(struct chat *chat)
+{
+    printf("sent %llu messages over %s\n", (unsigned long long)chat->seq,
+           chat->transport == TRANSPORT_SHM ? "shm" : "fifo");
+    if (chat->transport == TRANSPORT_SHM)
+    {
+        uint64_t head = atomic_load(&chat->ring->head);
+        printf("ring: %llu messages behind, %llu lost\n",
+               (unsigned long long)(head - chat->reader.cursor),
+               (unsigned long long)atomic_load(&chat->reader.lost));
+        return;
+    }
+    struct room *room = &chat->room;
+    printf("queues: %s at %zu bytes, %llu messages dropped, %llu readers disconnected\n",
+           queue_policies[room->policy], room->queue_limit, (unsigned long long)room->dropped,
+           (unsigned long long)room->disconnected);
+    for (int i = 0; i < room->count; i++)
+    {
+        struct member *member = &room->members[i];
+        printf("  %-16s %5d queued %7zu bytes %6llu dropped%s\n", member->name,
+               member->queue.frames, member->queue.end - member->queue.start,
+               (unsigned long long)member->dropped,
+               member->kicked ? "  disconnected" : member->fd == -1 ? "  not reading" : "");
+    }
+}
+
+/**
+ * Lines typed by the user, read as they come and sent once complete
+ */
+struct outbox
+{
+    char data[PIPE_BUF];
+    size_t len;
+};
+
+/**
+ * Bytes of the frames a message is sent in
+ * @param  user_len [description]
+ * @param  len      bytes of text
+ * @return          [description]
+ */
+static size_t message_size(size_t user_len, size_t len)
+{
+    size_t first = FRAME_PAYLOAD_MAX - user_len - 1;
+    size_t frames = len <= first ? 1 : 2 + (len - first - 1) / FRAME_PAYLOAD_MAX;
+    return frames * sizeof(struct frame_header) + user_len + 1 + len;
+}
+
+/**
+ * Broadcast the complete lines of the outbox, or all of it at the end of input.
+ * Lines that arrived together go out together, as few batches as they fit in.
+ * A line longer than a frame goes in several, all in the same batch; one
+ * longer than a batch holds is cut.
+ * @param outbox [description]
+ * @param chat   [description]
+ * @param all    send an incomplete last line too
+ */
+static void outbox_send(struct outbox *outbox, struct chat *chat, bool all)
+{
+    static struct batch batch;
+    char *line = outbox->data, *end = outbox->data + outbox->len, *newline;
+    size_t user_len = strlen(chat->username);
+    size_t max = PIPE_BUF, size;
+    while ((size = message_size(user_len, max)) > PIPE_BUF)
+        max -= size - PIPE_BUF;
+    bool sent = false;
+    if (chat->transport == TRANSPORT_FIFO)
+        room_update(&chat->room); // a no-op with inotify, events come through epoll
+    while (line < end)
+    {
+        size_t len;
+        if ((newline = memchr(line, '\n', end - line)) != NULL)
+            len = newline - line + 1;
+        else if (all || (size_t)(end - line) >= max)
+            len = end - line;
+        else
+            break;
+        // the rest of a line longer than that is another message
+        if (len > max)
+            len = max;
+        if (len == sizeof("/metrics") && memcmp(line, "/metrics\n", len) == 0)
+        {
+            chat_metrics(chat);
+            line += len;
+            sent = true;
+            continue;
+        }
+        if (batch.bytes + message_size(user_len, len) > PIPE_BUF)
+            chat_send(chat, &batch);
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        for (size_t offset = 0, n; offset < len; offset += n)
+        {
+            struct frame_header header = {
+                .flags = offset > 0 ? FRAME_CONTINUED : 0,
+                .sender = chat->sender,
+                .seq = chat->seq++,
+                .timestamp = now.tv_sec * 1000000000ull + now.tv_nsec,
+            };
+            n = offset > 0 ? FRAME_PAYLOAD_MAX : FRAME_PAYLOAD_MAX - user_len - 1;
+            if (n > len - offset)
+                n = len - offset;
+            batch_add(&batch, header, offset > 0 ? NULL : chat->username, line + offset, n);
+        }
+        line += len;
+        sent = true;
+    }
+    // the batch points into the outbox, it goes before the outbox moves
+    chat_send(chat, &batch);
+    outbox->len = end - line;
+    memmove(outbox->data, line, outbox->len);
+    if (sent && !all)
+    {
+        printf("Your Message:");
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // chatroom [-t fifo|shm] [-p policy] [-q bytes] [-n count] [-s time] <roomname> <username>
+    struct chat chat;
+    memset(&chat, 0, sizeof(chat));
+    chat.room.queue_limit = 64 * 1024; // as much again as the FIFO holds
+    uint64_t replay_last = 0, replay_since = 0;
+    bool replay = false, usage = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:p:q:n:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            if (strcmp(optarg, "shm") == 0)
+                chat.transport = TRANSPORT_SHM;
+            else if (strcmp(optarg, "fifo") != 0)
+                usage = true;
+            break;
+        case 'p':
+            usage = true;
+            for (int i = 0; i < 3; i++)
+                if (strcmp(optarg, queue_policies[i]) == 0)
+                {
+                    chat.room.policy = i;
+                    usage = false;
                 }
+            break;
+        case 'q':
+            chat.room.queue_limit = strtoull(optarg, NULL, 10);
+            usage |= chat.room.queue_limit < FRAME_MAX;
+            break;
+        case 'n':
+            replay_last = strtoull(optarg, NULL, 10);
+            replay = true;
+            break;
+        case 's':
+            replay_since = parse_since(optarg);
+            usage |= replay_since == 0;
+            replay = true;
+            break;
+        default:
+            usage = true;
+        }
+    }
+    // check for enough arguments
+    if (usage || argc - optind < 2)
+    {
+        fprintf(stderr,
+                "usage: %s [-t fifo|shm] [-p drop-oldest|drop-newest|disconnect] [-q bytes]\n"
+                "       [-n count] [-s time] <roomname> <username>\n",
+                argv[0]);
+        return 1;
+    }
+    const char *roomname = argv[optind];
+    chat.username = argv[optind + 1];
+    chat.sender = getpid();
+    if (strlen(chat.username) > 255)
+    {
+        fprintf(stderr, "%s: user name too long\n", argv[0]);
+        return 1;
+    }
+    // create chatroom directory
+    char chatroom[BUFFSIZ];
+    snprintf(chatroom, sizeof(chatroom), "/tmp/chatroom-%s", roomname);
 
-                memset(new_message, 0, 2048);
-                memset(directory, 0, 2048);
+    mkdir(chatroom, 0700);
+    if (log_open(&chat.log, chatroom) == -1)
+        perror("message log");
 
-                close(fd_write);
-            }
-            memset(message, 0, BUFFSIZ);
-            closedir(chatroom_dir);
+    // create named pipe
+    char pipename[BUFFSIZ];
+    snprintf(pipename, sizeof(pipename), "/tmp/chatroom-%s/%s", roomname, chat.username);
+
+    // one process per user: stdin, the user's FIFO, the room directory and
+    // the signals that end the session all come through one epoll loop. With
+    // shared memory a thread follows the ring instead.
+    chat.inbox.fd = chat.room.inotify_fd = -1;
+    uint64_t cursor = 0;
+    if (chat.transport == TRANSPORT_SHM)
+    {
+        chat.ring = ring_open(roomname, &chat.ring_fd);
+        if (chat.ring == NULL)
+        {
+            fprintf(stderr, "%s: shared memory: %s\n", argv[0], strerror(errno));
+            return 1;
         }
+        cursor = atomic_load(&chat.ring->head);
     }
     else
     {
-        // parent process for reading
-        int fd_read;
-        char read_message[BUFFSIZ];
+        if (inbox_open(&chat.inbox, pipename) == -1)
+        {
+            perror(pipename);
+            return 1;
+        }
+        if (room_open(&chat.room, chatroom) == -1)
+        {
+            perror(chatroom);
+            unlink(pipename);
+            return 1;
+        }
+    }
+    // joined: what is sent from now on arrives, the FIFO holds it or the
+    // reader starts at the cursor, so the log is caught up with first. A
+    // message sent while joining can show up twice.
+    if (replay)
+        log_replay(&chat.log, replay_last, replay_since);
+    // a reader that leaves must not kill us
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    // blocked before the ring reader starts, it inherits the mask
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (chat.transport == TRANSPORT_SHM)
+    {
+        int r = ring_reader_start(&chat.reader, chat.ring, cursor);
+        if (r != 0)
+        {
+            fprintf(stderr, "%s: shared memory: %s\n", argv[0], strerror(r));
+            return 1;
+        }
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    chat.room.epoll_fd = epoll_fd; // for members that can't take more yet
+    int watched[] = {STDIN_FILENO, chat.inbox.fd, chat.room.inotify_fd, signal_fd};
+    bool stdin_polled = true;
+    for (int i = 0; i < 4; i++)
+    {
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = watched[i]};
+        if (watched[i] == -1)
+            continue;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watched[i], &event) == -1)
+        {
+            // a regular file can't be polled, it is always readable anyway
+            if (i == 0 && errno == EPERM)
+                stdin_polled = false;
+            else
+                perror("epoll_ctl");
+        }
+    }
 
-        while ((1))
+    struct outbox outbox = {.len = 0};
+    bool running = true, reading = true;
+    double linger = 0;
+    printf("Your Message:");
+    fflush(stdout);
+    // at the end of input, what is queued still gets some time to go out
+    while (running && (reading || (room_queued(&chat.room) > 0 && now() < linger)))
+    {
+        struct epoll_event events[64];
+        int timeout = reading ? (stdin_polled ? -1 : 0) : (linger - now()) * 1e3 + 1;
+        int n = epoll_wait(epoll_fd, events, 64, timeout);
+        if (n == -1 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
+        bool input = !stdin_polled;
+        for (int i = 0; i < n; i++)
         {
-            // open named pipe for reading
-            fd_read = open(pipename, O_RDONLY);
-            // read messages
-            if ((read(fd_read, read_message, sizeof(read_message))) == -1)
+            int fd = events[i].data.fd;
+            if (fd == STDIN_FILENO)
+                input = true;
+            else if (fd == chat.inbox.fd)
             {
-                perror("Error in reading:");
+                inbox_drain(&chat.inbox);
+                if (chat.inbox.kicked)
+                {
+                    // a FIFO created anew is a member joining, for everybody
+                    fprintf(stderr, "[disconnected for reading too slowly, joining again]\n");
+                    close(chat.inbox.fd);
+                    unlink(pipename);
+                    if (inbox_open(&chat.inbox, pipename) == -1)
+                    {
+                        perror(pipename);
+                        running = false;
+                        break;
+                    }
+                    struct epoll_event event = {.events = EPOLLIN, .data.fd = chat.inbox.fd};
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, chat.inbox.fd, &event);
+                }
+            }
+            else if (fd == chat.room.inotify_fd)
+                room_update(&chat.room);
+            else if (fd == signal_fd)
+                running = false;
+            else
+                room_writable(&chat.room, fd);
+        }
+        if (input && reading)
+        {
+            ssize_t len = read(STDIN_FILENO, outbox.data + outbox.len,
+                               sizeof(outbox.data) - outbox.len);
+            if (len > 0)
+            {
+                outbox.len += len;
+                outbox_send(&outbox, &chat, false);
+            }
+            else if (len == 0 || errno != EAGAIN)
+            {
+                outbox_send(&outbox, &chat, true);
+                reading = false;
+                linger = now() + CHAT_LINGER_MS / 1e3;
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
             }
-            printf("%s", read_message);
-
-            memset(read_message, 0, BUFFSIZ);
-            close(fd_read);
         }
     }
-}
\ No newline at end of file
+    // leave the room
+    if (chat.transport == TRANSPORT_SHM)
+    {
+        ring_reader_stop(&chat.reader);
+        ring_close(chat.ring, chat.ring_fd, roomname);
+    }
+    else
+    {
+        room_close(&chat.room);
+        unlink(pipename);
+    }
+    return 0;
+}
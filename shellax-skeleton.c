@@ -3,19 +3,36 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <termios.h> // termios, TCSANOW, ECHO, ICANON
 #include <unistd.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <sys/inotify.h>
+#include <spawn.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <pwd.h>
+#include <limits.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
 
 const char *sysname = "shellax";
 
+extern char **environ;
+
 enum return_codes
 {
     SUCCESS = 0,
@@ -23,17 +40,191 @@ enum return_codes
     UNKNOWN = 2,
 };
 
+typedef enum
+{
+    REDIRECT_READ = 0,   // <
+    REDIRECT_WRITE,      // >, and &> together with a copy of 1 onto 2
+    REDIRECT_APPEND,     // >>
+    REDIRECT_READ_WRITE, // <>
+    REDIRECT_DUP,        // n>&m and n<&m, n>&- closes n
+    REDIRECT_HEREDOC,    // << and <<-
+    REDIRECT_HERESTRING, // <<<
+} REDIRECT_TYPE;
+
+struct redirect
+{
+    REDIRECT_TYPE type;
+    int fd;          // the fd it sets up
+    int source;      // REDIRECT_DUP: fd to copy, -1 to close fd
+    char *target;    // file name, here-string, or the delimiter of a
+                     // here-document until its body replaces it
+    size_t length;   // of a here-document body
+    bool strip_tabs; // <<- drops leading tabs from the body
+    struct redirect *next;
+};
+
 struct command_t
 {
     char *name;
     bool background;
-    bool auto_complete;
     int arg_count;
     char **args;
-    char *redirects[3];     // in/out redirection
-    struct command_t *next; // for piping
+    struct redirect *redirects; // applied in the order given
+    struct command_t *next;     // for piping
+};
+
+/**
+ * Bump allocator that owns everything parsed from one input line: the
+ * command_t chain, argument vectors, names and redirect targets. Freeing a
+ * line is a single reset, and the chunks are kept for the next line, so
+ * steady-state parsing never calls the heap. heap_calls counts every
+ * malloc/free the arena itself makes.
+ */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_KEEP_SIZE (1024 * 1024) // larger chunks are released on reset
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size, used;
+    char data[];
+};
+
+struct arena
+{
+    struct arena_chunk *head, *current;
+    unsigned long heap_calls;
+    unsigned long heap_calls_at_reset;
+    size_t used, peak; // bytes handed out since the last reset, and the most ever
+    int pins;          // arena_reset does nothing while something still uses it
 };
 
+struct arena command_arena = {NULL, NULL, 0, 0, 0, 0, 0};
+
+/**
+ * Allocate from an arena, 16-byte aligned
+ * @param  arena [description]
+ * @param  size  [description]
+ * @return       zero-filled memory, valid until the next arena_reset
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    struct arena_chunk *chunk = arena->current;
+    // move on to chunks kept from earlier lines before asking the heap
+    while (chunk && chunk->used + size > chunk->size && chunk->next &&
+           chunk->next->size >= size)
+    {
+        chunk = chunk->next;
+        chunk->used = 0;
+    }
+    if (chunk == NULL || chunk->used + size > chunk->size)
+    {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        struct arena_chunk *fresh = malloc(sizeof(struct arena_chunk) + chunk_size);
+        arena->heap_calls++;
+        fresh->size = chunk_size;
+        fresh->used = 0;
+        if (chunk == NULL)
+        {
+            fresh->next = arena->head;
+            arena->head = fresh;
+        }
+        else
+        {
+            fresh->next = chunk->next;
+            chunk->next = fresh;
+        }
+        chunk = fresh;
+    }
+    arena->current = chunk;
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    if (arena->used > arena->peak)
+        arena->peak = arena->used;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+/**
+ * Grow an arena allocation, in place when it is the latest one
+ * @param  arena    [description]
+ * @param  ptr      allocation to grow, may be NULL
+ * @param  old_size [description]
+ * @param  new_size [description]
+ * @return          the grown allocation
+ */
+void *arena_realloc(struct arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    struct arena_chunk *chunk = arena->current;
+    size_t old_aligned = (old_size + 15) & ~(size_t)15;
+    size_t new_aligned = (new_size + 15) & ~(size_t)15;
+    if (ptr != NULL && chunk && (char *)ptr + old_aligned == chunk->data + chunk->used &&
+        chunk->used - old_aligned + new_aligned <= chunk->size)
+    {
+        chunk->used += new_aligned - old_aligned;
+        arena->used += new_aligned - old_aligned;
+        if (arena->used > arena->peak)
+            arena->peak = arena->used;
+        return ptr;
+    }
+    void *fresh = arena_alloc(arena, new_size);
+    if (ptr != NULL)
+        memcpy(fresh, ptr, old_size);
+    return fresh;
+}
+
+/**
+ * Copy a string of known length into an arena
+ * @param  arena [description]
+ * @param  str   [description]
+ * @param  len   [description]
+ * @return       NUL-terminated copy
+ */
+char *arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+    return arena_strndup(arena, str, strlen(str));
+}
+
+/**
+ * Release everything allocated from an arena at once. Chunks are kept for
+ * reuse, except oversized ones past ARENA_KEEP_SIZE. A pinned arena only
+ * grows, until the last pin goes.
+ * @param arena [description]
+ */
+void arena_reset(struct arena *arena)
+{
+    if (arena->pins > 0)
+        return;
+    size_t kept = 0;
+    struct arena_chunk **link = &arena->head;
+    while (*link)
+    {
+        struct arena_chunk *chunk = *link;
+        if (kept + chunk->size > ARENA_KEEP_SIZE && chunk != arena->head)
+        {
+            *link = chunk->next;
+            free(chunk);
+            arena->heap_calls++;
+            continue;
+        }
+        kept += chunk->size;
+        chunk->used = 0;
+        link = &chunk->next;
+    }
+    arena->current = arena->head;
+    arena->used = 0;
+    arena->heap_calls_at_reset = arena->heap_calls;
+}
+
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -43,11 +234,14 @@ void print_command(struct command_t *command)
     int i = 0;
     printf("Command: <%s>\n", command->name);
     printf("\tIs Background: %s\n", command->background ? "yes" : "no");
-    printf("\tNeeds Auto-complete: %s\n", command->auto_complete ? "yes" : "no");
     printf("\tRedirects:\n");
-    for (i = 0; i < 3; i++)
-        printf("\t\t%d: %s\n", i,
-               command->redirects[i] ? command->redirects[i] : "N/A");
+    for (struct redirect *r = command->redirects; r; r = r->next)
+    {
+        if (r->type == REDIRECT_DUP)
+            printf("\t\t%d: &%d\n", r->fd, r->source);
+        else
+            printf("\t\t%d: %s\n", r->fd, r->target);
+    }
     printf("\tArguments (%d):\n", command->arg_count);
     for (i = 0; i < command->arg_count; ++i)
         printf("\t\tArg %d: %s\n", i, command->args[i]);
@@ -58,607 +252,4874 @@ void print_command(struct command_t *command)
     }
 }
 /**
- * Release allocated memory of a command
+ * Release allocated memory of a command. The whole chain lives in the
+ * command arena, so this is a single reset.
  * @param  command [description]
  * @return         [description]
  */
 int free_command(struct command_t *command)
 {
-    if (command->arg_count)
-    {
-        for (int i = 0; i < command->arg_count; ++i)
-            free(command->args[i]);
-        free(command->args);
-    }
-    for (int i = 0; i < 3; ++i)
-        if (command->redirects[i])
-            free(command->redirects[i]);
-    if (command->next)
-    {
-        free_command(command->next);
-        command->next = NULL;
-    }
-    free(command->name);
-    free(command);
+    arena_reset(&command_arena);
     return 0;
 }
+
+/**
+ * Chrome trace-event export, enabled with SHELLAX_TRACE=file.json. Every
+ * phase of running a line becomes an event: the shell's own work on track 0
+ * and each stage of a pipeline on track N for stage N. Events are written one
+ * line per write() to an O_APPEND fd, so forked children can add theirs.
+ * With tracing off each trace point costs one predictable branch.
+ */
+struct trace
+{
+    int fd;
+    pid_t pid;        // the shell's, children report on its tracks
+    int tracks_named; // tracks that got a thread_name event, main thread only
+    int track;        // track of the stage being started, for the child
+};
+
+struct trace trace = {-1, 0, 0, 0};
+
+#define tracing() __builtin_expect(trace.fd != -1, 0)
+#define TRACE_START(var) double var = tracing() ? trace_clock() : 0
+#define TRACE_END(name, track, start, detail)                                  \
+    do                                                                         \
+    {                                                                          \
+        if (tracing())                                                         \
+            trace_event(name, 'X', track, start, trace_clock(), detail);      \
+    } while (0)
+
 /**
- * Show the command prompt
+ * Monotonic clock in the microseconds trace events use
  * @return [description]
  */
-int show_prompt()
+double trace_clock()
 {
-    char cwd[1024], hostname[1024];
-    gethostname(hostname, sizeof(hostname));
-    getcwd(cwd, sizeof(cwd));
-    printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
-    return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
 }
-// I/O Redirection enum 
-typedef enum
-{
-    IN = 0,
-    OUT,
-    APPEND,
-    DIRECTION_MAX
-} DIRECTION;
 
 /**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
+ * Copy a string into a JSON string literal, truncated to fit
+ * @param  out  [description]
+ * @param  size [description]
+ * @param  str  [description]
+ * @return      bytes written, without the NUL
  */
-int parse_command(char *buf, struct command_t *command)
+static size_t json_escape(char *out, size_t size, const char *str)
 {
-    const char *splitters = " \t"; // split at whitespace
-    int index, len;
-    len = strlen(buf);
-    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
+    size_t n = 0;
+    for (; *str && n + 7 < size; str++)
     {
-        buf++;
-        len--;
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+            n += sprintf(out + n, "\\%c", c);
+        else if (c < 0x20)
+            n += sprintf(out + n, "\\u%04x", c);
+        else
+            out[n++] = c;
     }
-    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-        buf[--len] = 0; // trim right whitespace
-
-    if (len > 0 && buf[len - 1] == '?') // auto-complete
-        command->auto_complete = true;
-    if (len > 0 && buf[len - 1] == '&') // background
-        command->background = true;
+    out[n] = 0;
+    return n;
+}
 
-    char *pch = strtok(buf, splitters);
-    if (pch == NULL)
+/**
+ * Name the tracks up to the given one that have no name yet. Only the main
+ * thread does, before the stages that report on them start, so builtin
+ * threads and forked children never touch tracks_named.
+ * @param track last track to name
+ */
+void trace_name_tracks(int track)
+{
+    char line[1024], text[64];
+    int n = 0;
+    for (; trace.tracks_named <= track; trace.tracks_named++)
     {
-        command->name = (char *)malloc(1);
-        command->name[0] = 0;
+        if (trace.tracks_named == 0)
+            snprintf(text, sizeof(text), "%s", sysname);
+        else
+            snprintf(text, sizeof(text), "stage %d", trace.tracks_named);
+        n += snprintf(line + n, sizeof(line) - n,
+                      "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+                      "\"tid\": %d, \"args\": {\"name\": \"%s\"}},\n",
+                      trace.pid, trace.tracks_named, text);
+        if (n >= (int)sizeof(line) / 2)
+        {
+            write(trace.fd, line, n);
+            n = 0;
+        }
     }
-    else
+    if (n > 0)
+        write(trace.fd, line, n);
+}
+
+/**
+ * Write one trace event, in a single write() so that the events of builtin
+ * threads and children don't interleave
+ * @param name   [description]
+ * @param phase  'X' for a span from start to end, 'i' for an instant at start
+ * @param track  0 for the shell, N for stage N of the pipeline
+ * @param start  [description]
+ * @param end    [description]
+ * @param detail shown as the event's argument, may be NULL
+ */
+void trace_event(const char *name, char phase, int track, double start, double end,
+                 const char *detail)
+{
+    char line[1024], text[512];
+    json_escape(text, sizeof(text), detail ? detail : "");
+    int n = snprintf(line, sizeof(line),
+                  "{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"dur\": %.3f, "
+                  "\"pid\": %d, \"tid\": %d, \"s\": \"t\", \"args\": {\"detail\": \"%s\"}},\n",
+                  name, phase, start, phase == 'X' ? end - start : 0, trace.pid, track, text);
+    write(trace.fd, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+}
+
+static void trace_close()
+{
+    // a trailing event instead of a comma, then the array is complete
+    char line[256];
+    int n = snprintf(line, sizeof(line),
+                     "{\"name\": \"exit\", \"ph\": \"i\", \"ts\": %.3f, \"pid\": %d, "
+                     "\"tid\": 0, \"s\": \"t\"}\n]\n",
+                     trace_clock(), trace.pid);
+    write(trace.fd, line, n);
+    close(trace.fd);
+    trace.fd = -1;
+}
+
+/**
+ * Start tracing if SHELLAX_TRACE names a file
+ */
+void trace_open()
+{
+    const char *path = getenv("SHELLAX_TRACE");
+    if (path == NULL || *path == 0)
+        return;
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace.fd == -1)
     {
-        command->name = (char *)malloc(strlen(pch) + 1);
-        strcpy(command->name, pch);
+        fprintf(stderr, "-%s: SHELLAX_TRACE: %s: %s\n", sysname, path, strerror(errno));
+        return;
     }
+    trace.pid = getpid();
+    write(trace.fd, "[\n", 2);
+    trace_name_tracks(0);
+    atexit(trace_close);
+    // a shellax started from this one would truncate the file
+    unsetenv("SHELLAX_TRACE");
+}
 
-    command->args = (char **)malloc(sizeof(char *));
+/**
+ * Everything the prompt shows, gathered once instead of on every line. user
+ * and host never change and cwd is only updated by cd. The VCS branch is
+ * looked up by a worker thread, finding it may mean walking up a slow file
+ * system; the prompt is redrawn when it arrives.
+ */
+struct prompt_cache
+{
+    char user[256];
+    char host[256];
+    char cwd[PATH_MAX];
+    double last_duration; // seconds the last line took to run
 
-    int redirect_index;
-    int arg_index = 0;
-    char temp_buf[1024], *arg;
-    while (1)
-    {
-        // tokenize input on splitters
-        pch = strtok(NULL, splitters);
-        if (!pch)
-            break;
-        arg = temp_buf;
-        strcpy(arg, pch);
-        len = strlen(arg);
+    pthread_mutex_t lock; // guards the fields below
+    pthread_cond_t wake;
+    char branch[256]; // branch of request_dir, "" outside of a repository
+    char request_dir[PATH_MAX];
+    bool requested;
+    bool worker_started;
+    int notify[2]; // the worker writes a byte here when branch changes
+};
+struct prompt_cache prompt_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .notify = {-1, -1},
+};
 
-        if (len == 0)
-            continue;                                        // empty arg, go for next
-        while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-        {
-            arg++;
-            len--;
-        }
-        while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-            arg[--len] = 0; // trim right whitespace
-        if (len == 0)
-            continue; // empty arg, go for next
+#define PROMPT_SLOW_SECONDS 1.0 // show the duration of lines slower than this
 
-        // piping to another command
-        if (strcmp(arg, "|") == 0)
-        {
-            struct command_t *c = malloc(sizeof(struct command_t));
-            int l = strlen(pch);
-            pch[l] = splitters[0]; // restore strtok termination
-            index = 1;
-            while (pch[index] == ' ' || pch[index] == '\t')
-                index++; // skip whitespaces
+extern bool interactive;
+extern int last_status;
 
-            parse_command(pch + index, c);
-            pch[l] = 0; // put back strtok termination
-            command->next = c;
-            continue;
-        }
+// terminal settings, fetched once. The shell stays in raw mode between
+// lines and only goes back to cooked mode for foreground jobs.
+struct termios cooked_termios, raw_termios;
+bool term_raw_mode = false;
 
-        // background process
-        if (strcmp(arg, "&") == 0)
-            continue; // handled before
-                      // handle input redirection
-        redirect_index = -1;
-        memset(command->redirects, 0, 3);
-        if (arg[0] == '<')
-            redirect_index = IN;
-        if (arg[0] == '>')
-        {
-            if (len > 1 && arg[1] == '>')
-            {
-                redirect_index = APPEND;
-                arg++;
-                len--;
-            }
-            else
-                redirect_index = OUT;
-        }
-        if (redirect_index != -1)
-        {
-            command->redirects[redirect_index] = malloc(len);
-            strcpy(command->redirects[redirect_index], arg + 1);
-            continue;
-        }
+int write_all(int fd, const char *data, size_t len);
 
-        // normal arguments
-        if (len > 2 &&
-            ((arg[0] == '"' && arg[len - 1] == '"') ||
-             (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-        {
-            arg[--len] = 0;
-            arg++;
-        }
-        command->args =
-            (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-        command->args[arg_index] = (char *)malloc(len + 1);
-        strcpy(command->args[arg_index++], arg);
-    }
-    command->arg_count = arg_index;
-    return 0;
+void term_raw()
+{
+    if (!interactive || term_raw_mode)
+        return;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw_termios);
+    write_all(STDOUT_FILENO, "\33[?2004h", 8); // bracketed paste on
+    term_raw_mode = true;
 }
 
-void prompt_backspace()
+void term_cooked()
 {
-    putchar(8);   // go back 1
-    putchar(' '); // write empty over
-    putchar(8);   // go back 1 again
+    if (!term_raw_mode)
+        return;
+    write_all(STDOUT_FILENO, "\33[?2004l", 8);
+    tcsetattr(STDIN_FILENO, TCSANOW, &cooked_termios);
+    term_raw_mode = false;
 }
+
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Find the git branch dir is in, from the HEAD of the closest .git above it
+ * @param  dir    absolute path
+ * @param  branch [description]
+ * @param  size   [description]
+ * @return        false outside of a repository
  */
-int prompt(struct command_t *command)
+static bool vcs_branch(const char *dir, char *branch, size_t size)
 {
-    int index = 0;
-    char c;
-    char buf[4096];
-    static char oldbuf[4096];
-
-    // tcgetattr gets the parameters of the current terminal
-    // STDIN_FILENO will tell tcgetattr that it should write the settings
-    // of stdin to oldt
-    static struct termios backup_termios, new_termios;
-    tcgetattr(STDIN_FILENO, &backup_termios);
-    new_termios = backup_termios;
-    // ICANON normally takes care that one line at a time will be processed
-    // that means it will return if it sees a "\n" or an EOF or an EOL
-    new_termios.c_lflag &=
-        ~(ICANON |
-          ECHO); // Also disable automatic echo. We manually echo each char.
-    // Those new settings will be set to STDIN
-    // TCSANOW tells tcsetattr to change attributes immediately.
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
-    show_prompt();
-    buf[0] = 0;
+    char path[PATH_MAX + 16], head[256];
+    size_t len = strlen(dir);
+    if (len >= PATH_MAX)
+        return false;
+    memcpy(path, dir, len);
     while (1)
     {
-        c = getchar();
-        // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
-
-        if (c == 9) // handle tab
+        strcpy(path + len, "/.git/HEAD");
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1)
         {
-            buf[index++] = '?'; // autocomplete
-            break;
+            ssize_t n = read(fd, head, sizeof(head) - 1);
+            close(fd);
+            if (n <= 0)
+                return false;
+            head[n] = '\0';
+            head[strcspn(head, "\n")] = '\0';
+            if (strncmp(head, "ref: refs/heads/", 16) == 0)
+                snprintf(branch, size, "%s", head + 16);
+            else // detached, show the commit
+                snprintf(branch, size, "%.7s", head);
+            return true;
         }
+        if (len == 0)
+            return false;
+        // drop the last component and its slash
+        while (len > 0 && path[len - 1] != '/')
+            len--;
+        if (len > 0)
+            len--;
+    }
+}
 
-        if (c == 127) // handle backspace
-        {
-            if (index > 0)
-            {
-                prompt_backspace();
-                index--;
-            }
-            continue;
-        }
+static void *prompt_worker(void *arg)
+{
+    char dir[PATH_MAX], branch[256];
+    pthread_mutex_lock(&prompt_cache.lock);
+    while (1)
+    {
+        while (!prompt_cache.requested)
+            pthread_cond_wait(&prompt_cache.wake, &prompt_cache.lock);
+        prompt_cache.requested = false;
+        strcpy(dir, prompt_cache.request_dir);
+        pthread_mutex_unlock(&prompt_cache.lock);
 
-        if (c == 27 || c == 91 || c == 66 || c == 67 || c == 68)
-        {
-            continue;
-        }
+        if (!vcs_branch(dir, branch, sizeof(branch)))
+            branch[0] = '\0';
 
-        if (c == 65) // up arrow
+        pthread_mutex_lock(&prompt_cache.lock);
+        // a newer request makes this answer stale
+        if (!prompt_cache.requested && strcmp(branch, prompt_cache.branch) != 0)
         {
-            while (index > 0)
-            {
-                prompt_backspace();
-                index--;
-            }
-
-            char tmpbuf[4096];
-            printf("%s", oldbuf);
-            strcpy(tmpbuf, buf);
-            strcpy(buf, oldbuf);
-            strcpy(oldbuf, tmpbuf);
-            index += strlen(buf);
-            continue;
+            strcpy(prompt_cache.branch, branch);
+            char c = 0;
+            // non-blocking, a full pipe wakes the prompt just as well
+            if (write(prompt_cache.notify[1], &c, 1) == -1 && errno != EAGAIN)
+                break;
         }
-
-        putchar(c); // echo the character
-        buf[index++] = c;
-        if (index >= sizeof(buf) - 1)
-            break;
-        if (c == '\n') // enter key
-            break;
-        if (c == 4) // Ctrl+D
-            return EXIT;
     }
-    if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-        index--;
-    buf[index++] = '\0'; // null terminate string
-
-    strcpy(oldbuf, buf);
-
-    parse_command(buf, command);
+    pthread_mutex_unlock(&prompt_cache.lock);
+    return NULL;
+}
 
-    // print_command(command); // DEBUG: uncomment for debugging
+/**
+ * Ask the worker to look up the branch again, for the current cwd. Called
+ * after every line, a command may have switched branches.
+ */
+void prompt_refresh()
+{
+    if (!prompt_cache.worker_started)
+        return;
+    pthread_mutex_lock(&prompt_cache.lock);
+    strcpy(prompt_cache.request_dir, prompt_cache.cwd);
+    prompt_cache.requested = true;
+    pthread_cond_signal(&prompt_cache.wake);
+    pthread_mutex_unlock(&prompt_cache.lock);
+}
 
-    // restore the old settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-    return SUCCESS;
+/**
+ * Update the cached cwd, after a successful cd
+ */
+void prompt_set_cwd()
+{
+    if (getcwd(prompt_cache.cwd, sizeof(prompt_cache.cwd)) == NULL)
+        strcpy(prompt_cache.cwd, "?");
+    prompt_refresh();
 }
-int process_command(struct command_t *command, int *pipefd);
-int main()
+
+/**
+ * Gather what the prompt shows and fetch the terminal settings, once at startup
+ */
+void prompt_init()
 {
-    while (1)
+    const char *user = getenv("USER");
+    struct passwd *pw = user ? NULL : getpwuid(getuid());
+    snprintf(prompt_cache.user, sizeof(prompt_cache.user), "%s",
+             user ? user : pw ? pw->pw_name : "?");
+    gethostname(prompt_cache.host, sizeof(prompt_cache.host) - 1);
+
+    if (interactive && tcgetattr(STDIN_FILENO, &cooked_termios) == 0)
     {
-        struct command_t *command = malloc(sizeof(struct command_t));
-        memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+        raw_termios = cooked_termios;
+        // ICANON normally takes care that one line at a time will be processed
+        // that means it will return if it sees a "\n" or an EOF or an EOL
+        // Also disable automatic echo. We manually echo each char.
+        raw_termios.c_lflag &= ~(ICANON | ECHO);
 
-        int code;
-        code = prompt(command);
-        if (code == EXIT)
-            break;
+        if (pipe2(prompt_cache.notify, O_CLOEXEC | O_NONBLOCK) == 0)
+        {
+            // signals are for the main thread to handle
+            sigset_t all, old;
+            pthread_t thread;
+            sigfillset(&all);
+            pthread_sigmask(SIG_BLOCK, &all, &old);
+            if (pthread_create(&thread, NULL, prompt_worker, NULL) == 0)
+            {
+                pthread_detach(thread);
+                prompt_cache.worker_started = true;
+            }
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+        }
+    }
+    prompt_set_cwd();
+}
 
-        code = process_command(command, NULL);
-        if (code == EXIT)
-            break;
+/**
+ * Format the prompt line
+ * @param  buf  [description]
+ * @param  size [description]
+ * @return      [description]
+ */
+int format_prompt(char *buf, size_t size)
+{
+    char branch[sizeof(prompt_cache.branch) + 4], status[64] = "";
+    double duration = prompt_cache.last_duration;
+    char c;
 
-        free_command(command);
-    }
+    // whatever the worker announced so far is about to be shown
+    while (prompt_cache.notify[0] != -1 && read(prompt_cache.notify[0], &c, 1) == 1)
+        ;
+    pthread_mutex_lock(&prompt_cache.lock);
+    if (prompt_cache.branch[0])
+        snprintf(branch, sizeof(branch), " (%s)", prompt_cache.branch);
+    else
+        branch[0] = '\0';
+    pthread_mutex_unlock(&prompt_cache.lock);
 
-    printf("\n");
+    if (last_status != 0 && duration >= PROMPT_SLOW_SECONDS)
+        snprintf(status, sizeof(status), " [%d %.1fs]", last_status, duration);
+    else if (last_status != 0)
+        snprintf(status, sizeof(status), " [%d]", last_status);
+    else if (duration >= PROMPT_SLOW_SECONDS)
+        snprintf(status, sizeof(status), " [%.1fs]", duration);
+
+    snprintf(buf, size, "%s@%s:%s%s%s %s$ ", prompt_cache.user, prompt_cache.host,
+             prompt_cache.cwd, branch, status, sysname);
     return 0;
 }
-int process_command(struct command_t *command, int *pipefd_r)
+/**
+ * Tokens produced by the lexer. Words are slices of the input buffer,
+ * unquoted and unescaped in place, so lexing copies nothing.
+ */
+typedef enum
 {
-    int r;
-    // open pipe for handling program piping
-    int pipefd[2];
-    // check pipe relation between processes
-    // if next command is not null, then previous command has pipe
-    // connection with next command
-    bool is_piped = command->next != NULL;
-    if (is_piped)
-        pipe(pipefd);
+    TOKEN_END = 0,
+    TOKEN_WORD,
+    TOKEN_PIPE,         // |
+    TOKEN_BACKGROUND,   // &
+    TOKEN_REDIRECT,     // <, >, >>, <>, <&, >&, &>, &>>, <<, <<- or <<<
+} TOKEN_TYPE;
 
-    if (strcmp(command->name, "") == 0)
-        return SUCCESS;
+struct lexer
+{
+    char *pos;    // next byte to read
+    char pending; // operator byte overwritten by the terminator of a word
 
-    if (strcmp(command->name, "exit") == 0)
-        return EXIT;
+    // the last TOKEN_REDIRECT
+    REDIRECT_TYPE redirect;
+    int io_number;   // fd it applies to, given or the default
+    bool both;       // &> and &>>, stderr goes along
+    bool strip_tabs; // <<-
+    const char *op;  // for error messages
+};
+
+static TOKEN_TYPE lex_redirect(struct lexer *lexer, char *next, REDIRECT_TYPE type,
+                               int fd, const char *op)
+{
+    lexer->pos = next;
+    lexer->redirect = type;
+    if (lexer->io_number == -1)
+        lexer->io_number = fd;
+    lexer->op = op;
+    return TOKEN_REDIRECT;
+}
 
-    if (strcmp(command->name, "cd") == 0)
+/**
+ * Read the next token. Quotes may span whitespace and operators, a backslash
+ * escapes the next byte outside single quotes, and a word ends at unquoted
+ * whitespace or an operator. The word is compacted towards its start as
+ * quotes and escapes are dropped, which can never overtake the read position.
+ * @param  lexer [description]
+ * @param  word  set to the NUL-terminated word for TOKEN_WORD
+ * @return       token type
+ */
+TOKEN_TYPE lex_token(struct lexer *lexer, char **word)
+{
+    char *r = lexer->pos, c;
+    if (lexer->pending)
     {
-        if (command->arg_count > 0)
+        c = lexer->pending;
+        lexer->pending = 0;
+    }
+    else
+    {
+        while (*r == ' ' || *r == '\t')
+            r++;
+        c = *r;
+    }
+    lexer->io_number = -1;
+    lexer->both = lexer->strip_tabs = false;
+    if (c >= '0' && c <= '9')
+    {
+        // digits right before < or > name the fd of the redirect
+        char *end = r;
+        while (*end >= '0' && *end <= '9')
+            end++;
+        if (*end == '<' || *end == '>')
         {
-            r = chdir(command->args[0]);
-            if (r == -1)
-                printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-            return SUCCESS;
+            long fd = strtol(r, NULL, 10);
+            lexer->io_number = fd < INT_MAX ? fd : INT_MAX;
+            r = end;
+            c = *r;
         }
     }
-
-    pid_t pid = fork();
-    if (pid == 0) // child
-    {
-        /// This shows how to do exec with environ (but is not available on MacOs)
-        // extern char** environ; // environment variables
-        // execvpe(command->name, command->args, environ); // exec+args+path+environ
-
-        /// This shows how to do exec with auto-path resolve
-        // add a NULL argument to the end of args, and the name to the beginning
-        // as required by exec
-
-        // increase args size by 2
-        command->args = (char **)realloc(
-            command->args, sizeof(char *) * (command->arg_count += 2));
-
-        // shift everything forward by 1
-        for (int i = command->arg_count - 2; i > 0; --i)
-            command->args[i] = command->args[i - 1];
-
-        // set args[0] as a copy of name
-        command->args[0] = strdup(command->name);
-        // set args[arg_count-1] (last) to NULL
-        command->args[command->arg_count - 1] = NULL;
-        // check for filename and direction mode
-        DIRECTION dir_mode = 1000;
-        char *file_name;
-        for (int i = 0; i < DIRECTION_MAX; i++)
-        {
-            if (command->redirects[i] != NULL)
-            {
-                dir_mode = i;
-                file_name = command->redirects[i];
-            }
-        }
-        printf("exructing: %s\n", command->name);
-        // According to direction mode, redirect the file
-        switch (dir_mode)
+    switch (c)
+    {
+    case '#': // a comment runs to the end of the line
+    case 0:
+        lexer->pos = r;
+        return TOKEN_END;
+    case '|':
+        lexer->pos = r + 1;
+        return TOKEN_PIPE;
+    case '&':
+        if (r[1] == '>')
         {
-        case IN:
-            int fd_in = open(file_name, O_RDONLY, 0);
-            if (fd_in == -1)
-                fprintf(stderr, "file could not be read!");
-            dup2(fd_in, STDIN_FILENO);
-            close(fd_in);
-            break;
-        case OUT:
-            int fd_out = creat(file_name, 0644);
-            if (fd_out == -1)
-                fprintf(stderr, "file could not be created or truncated!");
-            dup2(fd_out, STDOUT_FILENO);
-            close(fd_out);
-            break;
-        case APPEND:
-            int fd_append = open(file_name, O_WRONLY | O_APPEND);
-            if (fd_append == -1)
-                fprintf(stderr, "file could not be found!");
-            dup2(fd_append, STDOUT_FILENO);
-            close(fd_append);
-            break;
+            lexer->both = true;
+            if (r[2] == '>')
+                return lex_redirect(lexer, r + 3, REDIRECT_APPEND, 1, "&>>");
+            return lex_redirect(lexer, r + 2, REDIRECT_WRITE, 1, "&>");
         }
-        // Function argument for piping multiple processes
-        // Read from this pipefd_r, duplicating the STDIN to pipefd_r[0]
-        if (pipefd_r != NULL)
+        lexer->pos = r + 1;
+        return TOKEN_BACKGROUND;
+    case '<':
+        if (r[1] == '<' && r[2] == '<')
+            return lex_redirect(lexer, r + 3, REDIRECT_HERESTRING, 0, "<<<");
+        if (r[1] == '<')
         {
-            close(pipefd_r[1]);
-            dup2(pipefd_r[0], STDIN_FILENO);
-            close(pipefd_r[0]);
+            lexer->strip_tabs = r[2] == '-';
+            return lex_redirect(lexer, r + 2 + lexer->strip_tabs, REDIRECT_HEREDOC, 0,
+                                lexer->strip_tabs ? "<<-" : "<<");
         }
-        // Check for pipe condition between processes and duplicate the 
-        // STDOUT of previous process to pipefd[1]
-        if (is_piped)
-        {
-            close(pipefd[0]);
-            dup2(pipefd[1], STDOUT_FILENO);
-            close(pipefd[1]);
+        if (r[1] == '>')
+            return lex_redirect(lexer, r + 2, REDIRECT_READ_WRITE, 0, "<>");
+        if (r[1] == '&')
+            return lex_redirect(lexer, r + 2, REDIRECT_DUP, 0, "<&");
+        return lex_redirect(lexer, r + 1, REDIRECT_READ, 0, "<");
+    case '>':
+        if (r[1] == '>')
+            return lex_redirect(lexer, r + 2, REDIRECT_APPEND, 1, ">>");
+        if (r[1] == '&')
+            return lex_redirect(lexer, r + 2, REDIRECT_DUP, 1, ">&");
+        if (r[1] == '|')
+            return lex_redirect(lexer, r + 2, REDIRECT_WRITE, 1, ">|");
+        return lex_redirect(lexer, r + 1, REDIRECT_WRITE, 1, ">");
+    }
 
-            assert(!((pipefd_r != NULL) && is_piped));
+    char *w = r, quote = 0;
+    *word = w;
+    for (; (c = *r) != 0; r++)
+    {
+        if (quote)
+        {
+            if (c == quote)
+                quote = 0;
+            else if (c == '\\' && quote == '"' && (r[1] == '"' || r[1] == '\\'))
+                *w++ = *++r;
+            else
+                *w++ = c;
+            continue;
         }
-        // Uniq command implementation
-        if (strcmp(command->name, "uniq") == 0)
+        if (c == ' ' || c == '\t' || c == '|' || c == '&' || c == '<' || c == '>')
+            break;
+        if (c == '"' || c == '\'')
+            quote = c;
+        else if (c == '\\' && r[1])
+            *w++ = *++r;
+        else
+            *w++ = c;
+    }
+    if (c == ' ' || c == '\t')
+        r++;
+    else if (c != 0)
+        lexer->pending = c; // the terminator may land on it
+    lexer->pos = r;
+    *w = 0;
+    return TOKEN_WORD;
+}
+
+/**
+ * Parse a command string into a command struct. The line is lexed once from
+ * left to right; a | starts the next command_t of the chain. Strings point
+ * into buf, which must outlive the command.
+ * @param  buf     [description]
+ * @param  command [description]
+ * @return         0, -1 on a syntax error (command is left empty)
+ */
+int parse_command(char *buf, struct command_t *command)
+{
+    TRACE_START(start);
+    struct lexer lexer = {buf, 0};
+    struct command_t *current = command;
+    struct redirect **redirect_tail = &command->redirects;
+    bool has_name = false;
+    int arg_capacity = 0;
+    char *word;
+    TOKEN_TYPE token;
+    const char *error = NULL;
+    current->name = "";
+    while ((token = lex_token(&lexer, &word)) != TOKEN_END)
+    {
+        switch (token)
         {
-            char buf[BUFSIZ];
-            memset(buf, 0, BUFSIZ);
-            // read from the STDIN and write to str 
-            int n_bytes;
-            char *str = malloc(BUFSIZ * sizeof(char));
-            while ((n_bytes = read(STDIN_FILENO, &buf, sizeof(buf))) > 0)
+        case TOKEN_WORD:
+            if (!has_name)
             {
-                strcat(str, buf);
-                memset(buf, 0, BUFSIZ);
+                current->name = word;
+                has_name = true;
+                break;
             }
-            // parse according to the newline
-            char *pch = NULL;
-
-            pch = strtok(str, "\n");
-            char *words[BUFSIZ];
-            memset(words, 0, BUFSIZ);
-            int word_count = 0;
-            while (pch != NULL)
+            if (current->arg_count == arg_capacity)
             {
-                words[word_count++] = pch;
-                pch = strtok(NULL, "\n");
+                arg_capacity = arg_capacity ? 2 * arg_capacity : 8;
+                current->args = arena_realloc(&command_arena, current->args,
+                                              sizeof(char *) * current->arg_count,
+                                              sizeof(char *) * arg_capacity);
             }
-            // find the unique words and put them into an array
-            char *unique_words[BUFSIZ];
-            int unique_words_size = 0;
-            for (int i = 0; i < word_count; i++)
+            current->args[current->arg_count++] = word;
+            break;
+        case TOKEN_PIPE:
+            if (!has_name)
             {
-                int j;
-                int count = 0;
-                if (words[i] != NULL)
-                {
-                    for (j = 0; j < word_count; j++)
-                    {
-                        if (words[j] != NULL)
-                        {
-                            if (!strcmp(words[i], words[j]))
-                            {
-                                break;
-                            }
-                        }
-                    }
-                    if (i == j)
-                    {
-                        unique_words[unique_words_size++] = words[i];
-                    }
-                }
+                error = "|";
+                break;
             }
-            // print unique elements
-            if (command->arg_count == 2)
+            current->next = arena_alloc(&command_arena, sizeof(struct command_t));
+            current = current->next;
+            current->name = "";
+            redirect_tail = &current->redirects;
+            has_name = false;
+            arg_capacity = 0;
+            break;
+        case TOKEN_BACKGROUND:
+            // copied to every stage below, it applies to the whole pipeline
+            command->background = true;
+            break;
+        case TOKEN_REDIRECT:
+        {
+            struct redirect *redirect = arena_alloc(&command_arena, sizeof(struct redirect));
+            redirect->type = lexer.redirect;
+            redirect->fd = lexer.io_number;
+            redirect->strip_tabs = lexer.strip_tabs;
+            bool both = lexer.both;
+            const char *op = lexer.op;
+            if (lex_token(&lexer, &word) != TOKEN_WORD)
             {
-                for (int i = 0; i < unique_words_size; i++)
-                {
-                    if (unique_words[i] != NULL)
-                    {
-                        printf("From our uniq:\t %s\n", unique_words[i]);
-                    }
+                error = op;
+                break;
+            }
+            redirect->target = word;
+            if (redirect->type == REDIRECT_DUP)
+            {
+                char *end;
+                long source = strtol(word, &end, 10);
+                if (strcmp(word, "-") == 0)
+                    redirect->source = -1;
+                else if (*word && *end == 0 && source < INT_MAX)
+                    redirect->source = source;
+                else if (strcmp(op, ">&") == 0)
+                {
+                    // >&file is &>file
+                    redirect->type = REDIRECT_WRITE;
+                    both = true;
+                }
+                else
+                {
+                    error = word;
+                    break;
+                }
+            }
+            *redirect_tail = redirect;
+            redirect_tail = &redirect->next;
+            if (both)
+            {
+                struct redirect *err = arena_alloc(&command_arena, sizeof(struct redirect));
+                err->type = REDIRECT_DUP;
+                err->fd = STDERR_FILENO;
+                err->source = redirect->fd;
+                *redirect_tail = err;
+                redirect_tail = &err->next;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        if (error)
+            break;
+    }
+    if (error == NULL && current != command && !has_name)
+        error = "|";
+    if (error)
+    {
+        printf("-%s: syntax error near unexpected token `%s'\n", sysname, error);
+        memset(command, 0, sizeof(struct command_t));
+        command->name = "";
+        TRACE_END("parse", 0, start, error);
+        return -1;
+    }
+
+    for (current = command; current; current = current->next)
+        current->background = command->background;
+    TRACE_END("parse", 0, start, NULL);
+    return 0;
+}
+
+/**
+ * Growable byte buffer, holds the line being edited and the frames that
+ * redraw it
+ */
+struct strbuf
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+void strbuf_insert(struct strbuf *sb, size_t at, const char *data, size_t len)
+{
+    if (sb->len + len > sb->cap)
+    {
+        size_t cap = sb->cap ? sb->cap : 256;
+        while (cap < sb->len + len)
+            cap *= 2;
+        sb->data = realloc(sb->data, cap);
+        sb->cap = cap;
+    }
+    memmove(sb->data + at + len, sb->data + at, sb->len - at);
+    memcpy(sb->data + at, data, len);
+    sb->len += len;
+}
+
+void strbuf_append(struct strbuf *sb, const char *data, size_t len)
+{
+    strbuf_insert(sb, sb->len, data, len);
+}
+
+void strbuf_printf(struct strbuf *sb, const char *format, ...)
+{
+    char tmp[64];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(tmp, sizeof(tmp), format, args);
+    va_end(args);
+    if (len > 0)
+        strbuf_append(sb, tmp, len < (int)sizeof(tmp) ? len : sizeof(tmp) - 1);
+}
+
+void strbuf_erase(struct strbuf *sb, size_t at, size_t len)
+{
+    memmove(sb->data + at, sb->data + at + len, sb->len - at - len);
+    sb->len -= len;
+}
+
+/**
+ * Read the bodies of the here-documents of a parsed line from the lines that
+ * follow it, in the order their << appear
+ * @param command   [description]
+ * @param next_line returns the next input line without its newline, NULL at
+ *                  the end of input
+ * @param arg       passed to next_line
+ */
+void read_heredocs(struct command_t *command, const char *(*next_line)(void *, size_t *),
+                   void *arg)
+{
+    for (struct command_t *c = command; c; c = c->next)
+    {
+        for (struct redirect *redirect = c->redirects; redirect; redirect = redirect->next)
+        {
+            if (redirect->type != REDIRECT_HEREDOC)
+                continue;
+            const char *delimiter = redirect->target, *line;
+            size_t delimiter_len = strlen(delimiter), len;
+            struct strbuf body = {NULL, 0, 0};
+            while ((line = next_line(arg, &len)) != NULL)
+            {
+                while (redirect->strip_tabs && len > 0 && *line == '\t')
+                {
+                    line++;
+                    len--;
                 }
+                if (len == delimiter_len && memcmp(line, delimiter, len) == 0)
+                    break;
+                strbuf_append(&body, line, len);
+                strbuf_append(&body, "\n", 1);
             }
-            // print unique elements with occurrences in the file
-            if (command->arg_count == 3 && (!strcmp(command->args[1], "-c") || !strcmp(command->args[1], "--count")))
+            if (line == NULL)
+                fprintf(stderr,
+                        "-%s: warning: here-document delimited by end-of-file (wanted `%s')\n",
+                        sysname, delimiter);
+            redirect->target = arena_alloc(&command_arena, body.len + 1);
+            if (body.len)
+                memcpy(redirect->target, body.data, body.len);
+            redirect->length = body.len;
+            free(body.data);
+        }
+    }
+}
+
+/**
+ * Persistent history, an append-only file of newline terminated entries at
+ * $SHELLAX_HISTORY or ~/.shellax_history. The file is mapped at startup and
+ * only indexed when history is first used; entries appended by other shells
+ * since then are indexed when the file is seen to have grown. Appends hold
+ * an flock, so concurrent shells never interleave partial entries.
+ */
+#define HISTORY_BLOCK 64        // entries sharing one block filter
+#define HISTORY_BLOCK_WORDS 128 // 8192 bits per block filter
+#define HISTORY_TILE 64         // block filters stored together
+
+struct history
+{
+    int fd;               // -1 if history only lives in memory
+    const char *map;      // the file, read-only
+    size_t map_len;
+    struct strbuf memory; // entries when there is no file
+    size_t *offsets;      // start of every entry
+    size_t count, capacity;
+    size_t indexed;  // bytes covered by offsets
+    struct strbuf last_added;
+    // for Ctrl+R, bloom filters of the trigrams in every entry and in every
+    // block of entries, so a search skips most blocks without reading them.
+    // Within a tile of block filters the same word of each block is adjacent,
+    // a search only reads the words its query has bits in.
+    uint64_t *signatures;
+    uint64_t *filters;
+    size_t signature_count, signature_capacity;
+};
+struct history history = {.fd = -1};
+
+void history_open()
+{
+    const char *path = getenv("SHELLAX_HISTORY"), *home = getenv("HOME");
+    char buf[PATH_MAX];
+    if (path == NULL && home != NULL)
+    {
+        snprintf(buf, sizeof(buf), "%s/.shellax_history", home);
+        path = buf;
+    }
+    if (path == NULL)
+        return;
+    history.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat st;
+    if (history.fd == -1 || fstat(history.fd, &st) == -1 || st.st_size == 0)
+        return;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+    if (map != MAP_FAILED)
+    {
+        history.map = map;
+        history.map_len = st.st_size;
+    }
+}
+
+static const char *history_data(size_t *len)
+{
+    if (history.fd == -1)
+    {
+        *len = history.memory.len;
+        return history.memory.data;
+    }
+    *len = history.map_len;
+    return history.map;
+}
+
+/**
+ * Pick up entries appended since the last call, by this or any other shell
+ */
+void history_sync()
+{
+    struct stat st;
+    if (history.fd != -1 && fstat(history.fd, &st) == 0 &&
+        (size_t)st.st_size != history.map_len)
+    {
+        if (history.map != NULL)
+            munmap((void *)history.map, history.map_len);
+        history.map = NULL;
+        history.map_len = 0;
+        void *map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0)
+                               : MAP_FAILED;
+        if (map != MAP_FAILED)
+        {
+            history.map = map;
+            history.map_len = st.st_size;
+        }
+    }
+
+    size_t len;
+    const char *data = history_data(&len);
+    if (len < history.indexed) // truncated under us, start over
+    {
+        history.count = history.indexed = history.signature_count = 0;
+    }
+    // only whole entries, a writer may be half way through one
+    const char *end;
+    while ((end = memchr(data + history.indexed, '\n', len - history.indexed)) != NULL)
+    {
+        if (history.count == history.capacity)
+        {
+            history.capacity = history.capacity ? history.capacity * 2 : 1024;
+            history.offsets = realloc(history.offsets, history.capacity * sizeof(size_t));
+        }
+        history.offsets[history.count++] = history.indexed;
+        history.indexed = end - data + 1;
+    }
+}
+
+const char *history_entry(size_t i, size_t *len)
+{
+    size_t data_len;
+    const char *data = history_data(&data_len);
+    size_t end = i + 1 < history.count ? history.offsets[i + 1] : history.indexed;
+    *len = end - history.offsets[i] - 1; // without the newline
+    return data + history.offsets[i];
+}
+
+/**
+ * Append a line, unless it is empty, starts with a space or repeats the
+ * last one. Only a consecutive repeat is left out; older ones stay in the
+ * log, and Up, Down and Ctrl+R skip an entry whose text they showed already
+ * (editor_visited).
+ * @param line [description]
+ * @param len  [description]
+ */
+void history_add(const char *line, size_t len)
+{
+    if (len == 0 || line[0] == ' ' || memchr(line, '\n', len) != NULL)
+        return;
+    if (len == history.last_added.len && memcmp(line, history.last_added.data, len) == 0)
+        return;
+    history.last_added.len = 0;
+    strbuf_append(&history.last_added, line, len);
+
+    if (history.fd == -1)
+    {
+        strbuf_append(&history.memory, line, len);
+        strbuf_append(&history.memory, "\n", 1);
+        return;
+    }
+    struct iovec iov[2] = {{(void *)line, len}, {"\n", 1}};
+    flock(history.fd, LOCK_EX);
+    writev(history.fd, iov, 2);
+    flock(history.fd, LOCK_UN);
+}
+
+// word w of the filter of block b
+static uint64_t *history_filter(size_t b, int w)
+{
+    size_t tile = b / HISTORY_TILE;
+    return &history.filters[(tile * HISTORY_BLOCK_WORDS + w) * HISTORY_TILE + b % HISTORY_TILE];
+}
+
+/**
+ * Set the bits of every trigram of text in a 64 bit signature and in a block
+ * filter
+ * @param text      [description]
+ * @param len       [description]
+ * @param signature [description]
+ * @param filter    HISTORY_BLOCK_WORDS words
+ */
+static void trigram_bits(const char *text, size_t len, uint64_t *signature, uint64_t *filter)
+{
+    uint64_t bits = *signature;
+    uint32_t trigram = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        trigram = (trigram << 8 | (uint8_t)text[i]) & 0xFFFFFF;
+        if (i < 2)
+            continue;
+        uint64_t h = trigram * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+        bits |= 1ull << (h >> 58);
+        // two bits in the block filter, it holds many more trigrams
+        uint32_t bit = (h >> 19) % (HISTORY_BLOCK_WORDS * 64);
+        filter[bit / 64] |= 1ull << (bit % 64);
+        bit = (h >> 6) % (HISTORY_BLOCK_WORDS * 64);
+        filter[bit / 64] |= 1ull << (bit % 64);
+    }
+    *signature = bits;
+}
+
+static void history_index_signatures()
+{
+    if (history.signature_capacity < history.count)
+    {
+        size_t per_tile = HISTORY_BLOCK * HISTORY_TILE, old = history.signature_capacity;
+        size_t capacity = old ? old : per_tile;
+        while (capacity < history.count)
+            capacity *= 2;
+        history.signatures = realloc(history.signatures, capacity * sizeof(uint64_t));
+        history.filters = realloc(history.filters,
+                                  capacity / per_tile * HISTORY_BLOCK_WORDS * HISTORY_TILE * sizeof(uint64_t));
+        memset(history.filters + old / per_tile * HISTORY_BLOCK_WORDS * HISTORY_TILE, 0,
+               (capacity - old) / per_tile * HISTORY_BLOCK_WORDS * HISTORY_TILE * sizeof(uint64_t));
+        history.signature_capacity = capacity;
+    }
+    // a block filter is built in local and stored when it is complete
+    size_t block = history.signature_count / HISTORY_BLOCK;
+    uint64_t local[HISTORY_BLOCK_WORDS];
+    for (int w = 0; w < HISTORY_BLOCK_WORDS; w++) // zero after a truncation
+        local[w] = history.signature_count % HISTORY_BLOCK ? *history_filter(block, w) : 0;
+    for (size_t id = history.signature_count; id < history.count; id++)
+    {
+        size_t len;
+        const char *entry = history_entry(id, &len);
+        history.signatures[id] = 0;
+        trigram_bits(entry, len, &history.signatures[id], local);
+        if ((id + 1) % HISTORY_BLOCK == 0 || id + 1 == history.count)
+        {
+            for (int w = 0; w < HISTORY_BLOCK_WORDS; w++)
+                *history_filter(block, w) = local[w];
+            memset(local, 0, sizeof(local));
+            block++;
+        }
+    }
+    history.signature_count = history.count;
+}
+
+static bool history_matches(size_t i, const char *query, size_t query_len)
+{
+    size_t len;
+    const char *entry = history_entry(i, &len);
+    return memmem(entry, len, query, query_len) != NULL;
+}
+
+/**
+ * Find the newest entry before the given one that contains query. For
+ * queries of three bytes or more, blocks and entries whose filters miss one
+ * of the query's trigrams are skipped without looking at their text.
+ * @param  query     [description]
+ * @param  query_len [description]
+ * @param  before    entry number to search below
+ * @return           entry number, -1 if none matches
+ */
+ssize_t history_search(const char *query, size_t query_len, size_t before)
+{
+    if (before > history.count)
+        before = history.count;
+    if (query_len < 3)
+    {
+        while (before-- > 0)
+            if (history_matches(before, query, query_len))
+                return before;
+        return -1;
+    }
+
+    history_index_signatures();
+    uint64_t signature = 0, filter[HISTORY_BLOCK_WORDS] = {0};
+    trigram_bits(query, query_len, &signature, filter);
+    // only the words of the block filters the query has bits in
+    int words[HISTORY_BLOCK_WORDS], nwords = 0;
+    for (int w = 0; w < HISTORY_BLOCK_WORDS; w++)
+        if (filter[w])
+            words[nwords++] = w;
+
+    size_t i = before;
+    while (i > 0)
+    {
+        size_t block = (i - 1) / HISTORY_BLOCK;
+        size_t block_start = block * HISTORY_BLOCK;
+        int w = 0;
+        while (w < nwords && (*history_filter(block, words[w]) & filter[words[w]]) == filter[words[w]])
+            w++;
+        if (w < nwords) // some trigram is in none of its entries
+        {
+            i = block_start;
+            continue;
+        }
+        for (; i > block_start; i--)
+            if ((history.signatures[i - 1] & signature) == signature &&
+                history_matches(i - 1, query, query_len))
+                return i - 1;
+    }
+    return -1;
+}
+
+/**
+ * State of the escape sequence decoder, kept across reads since a sequence
+ * may be split between two of them
+ */
+typedef enum
+{
+    KEY_NORMAL = 0,
+    KEY_ESC, // after \e
+    KEY_CSI, // after \e[, collecting parameters up to the final byte
+    KEY_SS3, // after \eO
+} KEY_STATE;
+
+typedef enum
+{
+    EDIT_CONTINUE = 0,
+    EDIT_SUBMIT,
+    EDIT_EXIT,
+} EDIT_ACTION;
+
+/**
+ * Line editor. Input is read in bulk into a buffer that outlives the line, a
+ * paste may hold several of them. Every batch of input is drawn with one write.
+ */
+struct line_editor
+{
+    char input[1 << 16];
+    size_t input_pos, input_len;
+    bool eof;
+    KEY_STATE state;
+    char params[16]; // of the CSI sequence being decoded
+    size_t params_len;
+    bool pasting; // between \e[200~ and \e[201~, bytes are inserted as is
+
+    struct strbuf line;
+    size_t cursor; // byte offset into line
+
+    // history entries shown since the line was started, newest first. Up
+    // skips the ones with the same text, Down walks back through them.
+    size_t *visited;
+    size_t visited_len, visited_capacity;
+    bool navigating;
+    struct strbuf saved; // the line as it was before history was used
+    bool searching;      // Ctrl+R
+    bool search_failed;
+    struct strbuf query;
+
+    char prompt[PATH_MAX + 1024];
+    bool continuation; // reading the lines of a here-document
+    struct strbuf search_prompt;
+    int cols;
+    int cursor_row; // row of the cursor within the last frame
+    struct strbuf frame;
+};
+struct line_editor editor;
+
+// columns a UTF-8 string takes, assuming one per character
+static size_t text_width(const char *text, size_t len)
+{
+    size_t width = 0;
+    for (size_t i = 0; i < len; i++)
+        width += (text[i] & 0xC0) != 0x80;
+    return width;
+}
+
+static bool utf8_continuation(struct line_editor *ed, size_t at)
+{
+    return at < ed->line.len && (ed->line.data[at] & 0xC0) == 0x80;
+}
+
+/**
+ * Draw the prompt and line over the previous frame, in a single write
+ * @param ed [description]
+ */
+static void editor_render(struct line_editor *ed)
+{
+    struct strbuf *frame = &ed->frame;
+    size_t cols = ed->cols;
+    const char *prompt = ed->prompt;
+    if (ed->searching)
+    {
+        ed->search_prompt.len = 0;
+        strbuf_printf(&ed->search_prompt, "(%sreverse-i-search)`",
+                      ed->search_failed ? "failed " : "");
+        strbuf_append(&ed->search_prompt, ed->query.data, ed->query.len);
+        strbuf_append(&ed->search_prompt, "': ", 4); // with the terminator
+        prompt = ed->search_prompt.data;
+    }
+    size_t prompt_width = text_width(prompt, strlen(prompt));
+    frame->len = 0;
+    // back to the start of the previous frame
+    if (ed->cursor_row > 0)
+        strbuf_printf(frame, "\33[%dA", ed->cursor_row);
+    strbuf_append(frame, "\r\33[J", 4);
+    strbuf_append(frame, prompt, strlen(prompt));
+    strbuf_append(frame, ed->line.data, ed->line.len);
+
+    size_t end = prompt_width + text_width(ed->line.data, ed->line.len);
+    size_t at = prompt_width + text_width(ed->line.data, ed->cursor);
+    // a full last row leaves the terminal waiting to wrap, wrap it now
+    if (end > 0 && end % cols == 0)
+        strbuf_append(frame, "\r\n", 2);
+    if (end / cols > at / cols)
+        strbuf_printf(frame, "\33[%zuA", end / cols - at / cols);
+    strbuf_append(frame, "\r", 1);
+    if (at % cols)
+        strbuf_printf(frame, "\33[%zuC", at % cols);
+    ed->cursor_row = at / cols;
+
+    fflush(stdout); // job notices go before the frame
+    write_all(STDOUT_FILENO, frame->data, frame->len);
+}
+
+/**
+ * Wait for more input, or for the prompt to need a redraw
+ * @param  ed [description]
+ * @return    1 for input, 0 for a redraw, -1 at the end of input
+ */
+static int editor_fill(struct line_editor *ed)
+{
+    struct pollfd fds[2] = {
+        {.fd = STDIN_FILENO, .events = POLLIN},
+        {.fd = prompt_cache.notify[0], .events = POLLIN},
+    };
+    fflush(stdout);
+    while (poll(fds, fds[1].fd != -1 ? 2 : 1, -1) == -1)
+        if (errno != EINTR)
+            return -1;
+    if (fds[0].revents == 0)
+        return 0;
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, ed->input, sizeof(ed->input))) == -1 && errno == EINTR)
+        ;
+    if (n <= 0)
+        return -1;
+    ed->input_pos = 0;
+    ed->input_len = n;
+    return 1;
+}
+
+static void editor_left(struct line_editor *ed)
+{
+    while (ed->cursor > 0 && utf8_continuation(ed, --ed->cursor))
+        ;
+}
+
+static void editor_right(struct line_editor *ed)
+{
+    while (ed->cursor < ed->line.len && utf8_continuation(ed, ++ed->cursor))
+        ;
+}
+
+static void editor_delete(struct line_editor *ed)
+{
+    size_t at = ed->cursor;
+    editor_right(ed);
+    strbuf_erase(&ed->line, at, ed->cursor - at);
+    ed->cursor = at;
+}
+
+static void editor_backspace(struct line_editor *ed)
+{
+    size_t at = ed->cursor;
+    editor_left(ed);
+    strbuf_erase(&ed->line, ed->cursor, at - ed->cursor);
+}
+
+static void editor_set_line(struct line_editor *ed, const char *text, size_t len)
+{
+    ed->line.len = 0;
+    strbuf_append(&ed->line, text, len);
+    ed->cursor = len;
+}
+
+static void editor_start_history(struct line_editor *ed)
+{
+    if (ed->navigating)
+        return;
+    history_sync();
+    ed->saved.len = 0;
+    strbuf_append(&ed->saved, ed->line.data, ed->line.len);
+    ed->visited_len = 0;
+    ed->navigating = true;
+}
+
+static void editor_restore(struct line_editor *ed)
+{
+    editor_set_line(ed, ed->saved.data, ed->saved.len);
+    ed->navigating = false;
+}
+
+// whether an entry with the same text was shown already
+static bool editor_visited(struct line_editor *ed, size_t id)
+{
+    size_t len, shown_len;
+    const char *entry = history_entry(id, &len);
+    for (size_t i = 0; i < ed->visited_len; i++)
+    {
+        const char *shown = history_entry(ed->visited[i], &shown_len);
+        if (shown_len == len && memcmp(shown, entry, len) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void editor_show_entry(struct line_editor *ed, size_t id)
+{
+    if (ed->visited_len == ed->visited_capacity)
+    {
+        ed->visited_capacity = ed->visited_capacity ? ed->visited_capacity * 2 : 64;
+        ed->visited = realloc(ed->visited, ed->visited_capacity * sizeof(size_t));
+    }
+    ed->visited[ed->visited_len++] = id;
+    size_t len;
+    const char *entry = history_entry(id, &len);
+    editor_set_line(ed, entry, len);
+}
+
+// last entry shown, or the end of history
+static size_t editor_history_pos(struct line_editor *ed)
+{
+    return ed->visited_len ? ed->visited[ed->visited_len - 1] : history.count;
+}
+
+static void editor_history_prev(struct line_editor *ed)
+{
+    editor_start_history(ed);
+    size_t i = editor_history_pos(ed);
+    while (i-- > 0)
+    {
+        if (!editor_visited(ed, i))
+        {
+            editor_show_entry(ed, i);
+            return;
+        }
+    }
+}
+
+static void editor_history_next(struct line_editor *ed)
+{
+    if (!ed->navigating)
+        return;
+    if (ed->visited_len > 0)
+        ed->visited_len--;
+    if (ed->visited_len == 0)
+    {
+        editor_restore(ed);
+        return;
+    }
+    size_t len;
+    const char *entry = history_entry(ed->visited[ed->visited_len - 1], &len);
+    editor_set_line(ed, entry, len);
+}
+
+/**
+ * Show the newest entry before the given one that matches the search query
+ * and has not been shown yet
+ * @param ed     [description]
+ * @param before entry number
+ */
+static void editor_search(struct line_editor *ed, size_t before)
+{
+    ssize_t i = before;
+    while ((i = history_search(ed->query.data, ed->query.len, i)) != -1 &&
+           editor_visited(ed, i))
+        ;
+    ed->search_failed = i == -1;
+    if (i == -1)
+        return;
+    editor_show_entry(ed, i);
+    char *match = memmem(ed->line.data, ed->line.len, ed->query.data, ed->query.len);
+    ed->cursor = match - ed->line.data;
+}
+
+// the query got longer, keep the match if it still fits
+static void editor_search_extend(struct line_editor *ed)
+{
+    if (ed->visited_len > 0)
+    {
+        size_t top = ed->visited[--ed->visited_len];
+        editor_search(ed, top + 1);
+    }
+    else if (!ed->search_failed)
+        editor_search(ed, history.count);
+}
+
+/**
+ * Act on the final byte of an escape sequence
+ * @param  ed    [description]
+ * @param  final [description]
+ * @return       [description]
+ */
+static EDIT_ACTION editor_sequence(struct line_editor *ed, char final)
+{
+    ed->params[ed->params_len] = '\0';
+    switch (final)
+    {
+    case 'A': // up
+        editor_history_prev(ed);
+        break;
+    case 'B': // down
+        editor_history_next(ed);
+        break;
+    case 'C': // right
+        editor_right(ed);
+        break;
+    case 'D': // left
+        editor_left(ed);
+        break;
+    case 'H': // home
+        ed->cursor = 0;
+        break;
+    case 'F': // end
+        ed->cursor = ed->line.len;
+        break;
+    case '~': // \e[N~ keys
+        switch (atoi(ed->params))
+        {
+        case 1:
+        case 7:
+            ed->cursor = 0;
+            break;
+        case 4:
+        case 8:
+            ed->cursor = ed->line.len;
+            break;
+        case 3:
+            editor_delete(ed);
+            break;
+        case 200:
+            ed->pasting = true;
+            break;
+        case 201:
+            ed->pasting = false;
+            break;
+        }
+        break;
+    }
+    return EDIT_CONTINUE;
+}
+
+void editor_complete(struct line_editor *ed);
+
+static EDIT_ACTION editor_key(struct line_editor *ed, unsigned char c)
+{
+    switch (ed->state)
+    {
+    case KEY_ESC:
+        ed->state = c == '[' ? KEY_CSI : c == 'O' ? KEY_SS3 : KEY_NORMAL;
+        ed->params_len = 0;
+        return EDIT_CONTINUE;
+    case KEY_CSI:
+        if (c < 0x40 || c > 0x7E) // parameter or intermediate byte
+        {
+            if (ed->params_len < sizeof(ed->params) - 1)
+                ed->params[ed->params_len++] = c;
+            return EDIT_CONTINUE;
+        }
+        ed->state = KEY_NORMAL;
+        return editor_sequence(ed, c);
+    case KEY_SS3:
+        ed->state = KEY_NORMAL;
+        return editor_sequence(ed, c);
+    case KEY_NORMAL:
+        break;
+    }
+
+    if (ed->searching)
+    {
+        switch (c)
+        {
+        case 18: // Ctrl+R, an older match
+            if (ed->query.len > 0)
+                editor_search(ed, editor_history_pos(ed));
+            return EDIT_CONTINUE;
+        case 127:
+        case 8:
+            while (ed->query.len > 0 && (ed->query.data[--ed->query.len] & 0xC0) == 0x80)
+                ;
+            ed->visited_len = 0;
+            ed->search_failed = false;
+            if (ed->query.len > 0)
+                editor_search(ed, history.count);
+            else
+                editor_set_line(ed, ed->saved.data, ed->saved.len);
+            return EDIT_CONTINUE;
+        case 7: // Ctrl+G, back to the line as it was
+            ed->searching = false;
+            editor_restore(ed);
+            return EDIT_CONTINUE;
+        default: // any other key takes the match and acts on it
+            ed->searching = false;
+            break;
+        }
+    }
+
+    switch (c)
+    {
+    case 18: // Ctrl+R
+        editor_start_history(ed);
+        ed->visited_len = 0;
+        ed->searching = true;
+        ed->search_failed = false;
+        ed->query.len = 0;
+        break;
+    case 27:
+        ed->state = KEY_ESC;
+        break;
+    case '\n':
+    case '\r':
+        return EDIT_SUBMIT;
+    case '\t':
+        editor_complete(ed);
+        break;
+    case 127: // backspace
+    case 8:   // Ctrl+H
+        editor_backspace(ed);
+        break;
+    case 1: // Ctrl+A
+        ed->cursor = 0;
+        break;
+    case 5: // Ctrl+E
+        ed->cursor = ed->line.len;
+        break;
+    case 11: // Ctrl+K
+        strbuf_erase(&ed->line, ed->cursor, ed->line.len - ed->cursor);
+        break;
+    case 21: // Ctrl+U
+        strbuf_erase(&ed->line, 0, ed->cursor);
+        ed->cursor = 0;
+        break;
+    case 4: // Ctrl+D
+        if (ed->line.len == 0)
+            return EDIT_EXIT;
+        editor_delete(ed);
+        break;
+    }
+    return EDIT_CONTINUE;
+}
+
+// bytes inserted into the line as they are
+static bool editor_literal(struct line_editor *ed, unsigned char c)
+{
+    if (ed->state != KEY_NORMAL || c == 27 || c == '\n' || c == '\r')
+        return false;
+    return ed->pasting || (c >= 32 && c != 127);
+}
+
+/**
+ * Consume the next key, or the whole run of plain text at the read position
+ * @param  ed [description]
+ * @return    [description]
+ */
+static EDIT_ACTION editor_feed(struct line_editor *ed)
+{
+    const char *text = ed->input + ed->input_pos;
+    size_t run = 0, avail = ed->input_len - ed->input_pos;
+    while (run < avail && editor_literal(ed, text[run]))
+        run++;
+    if (run > 0 && ed->searching)
+    {
+        strbuf_append(&ed->query, text, run);
+        ed->input_pos += run;
+        editor_search_extend(ed);
+        return EDIT_CONTINUE;
+    }
+    if (run > 0)
+    {
+        strbuf_insert(&ed->line, ed->cursor, text, run);
+        ed->cursor += run;
+        ed->input_pos += run;
+        return EDIT_CONTINUE;
+    }
+    ed->input_pos++;
+    return editor_key(ed, text[0]);
+}
+
+/**
+ * Read one line into the editor, drawing it as it is edited when the shell
+ * is interactive
+ * @param  ed [description]
+ * @return    EDIT_SUBMIT with the line in ed->line, EDIT_EXIT at the end of
+ *            input
+ */
+static EDIT_ACTION editor_read(struct line_editor *ed)
+{
+    struct winsize size;
+
+    ed->line.len = ed->cursor = 0;
+    ed->cursor_row = 0;
+    ed->navigating = ed->searching = false;
+    ed->cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col ? size.ws_col : 80;
+    if (interactive)
+        editor_render(ed);
+    else
+        printf("%s", ed->prompt);
+
+    EDIT_ACTION action = EDIT_CONTINUE;
+    while (action == EDIT_CONTINUE)
+    {
+        if (ed->input_pos == ed->input_len)
+        {
+            if (ed->eof)
+            {
+                // a last line without a newline still runs
+                action = ed->line.len ? EDIT_SUBMIT : EDIT_EXIT;
+                break;
+            }
+            int r = editor_fill(ed);
+            if (r == 0 && !ed->continuation) // an async segment arrived
+                format_prompt(ed->prompt, sizeof(ed->prompt));
+            ed->eof = r == -1;
+        }
+        // everything one read returned makes one frame, a paste makes one
+        // when it ends
+        while (action == EDIT_CONTINUE && ed->input_pos < ed->input_len)
+            action = editor_feed(ed);
+        if (action == EDIT_CONTINUE && interactive && !ed->pasting)
+            editor_render(ed);
+    }
+    if (action == EDIT_EXIT)
+        return action;
+
+    ed->searching = false;
+    ed->cursor = ed->line.len;
+    if (interactive)
+        editor_render(ed);
+    else
+        fwrite(ed->line.data, 1, ed->line.len, stdout);
+    printf("\n");
+    return action;
+}
+
+/**
+ * Read a line of a here-document, with a continuation prompt
+ * @param  arg the line editor
+ * @param  len [description]
+ * @return     the line, NULL at the end of input
+ */
+static const char *editor_next_line(void *arg, size_t *len)
+{
+    struct line_editor *ed = arg;
+    ed->continuation = true;
+    snprintf(ed->prompt, sizeof(ed->prompt), "> ");
+    EDIT_ACTION action = editor_read(ed);
+    ed->continuation = false;
+    if (action == EDIT_EXIT)
+        return NULL;
+    *len = ed->line.len;
+    return ed->line.data;
+}
+
+/**
+ * Show the command prompt and read a command from the user
+ * @param  command filled in from the line read
+ * @return         SUCCESS, EXIT at the end of input
+ */
+int prompt(struct command_t *command)
+{
+    struct line_editor *ed = &editor;
+
+    term_raw(); // a no-op unless a foreground job ran since the last line
+
+    format_prompt(ed->prompt, sizeof(ed->prompt));
+    if (editor_read(ed) == EDIT_EXIT)
+        return EXIT;
+
+    history_add(ed->line.data, ed->line.len);
+
+    // the parsed words point into the line, so it has to live in the arena
+    if (parse_command(arena_strndup(&command_arena, ed->line.data, ed->line.len), command) == 0)
+        read_heredocs(command, editor_next_line, ed);
+
+    // print_command(command); // DEBUG: uncomment for debugging
+    return SUCCESS;
+}
+/**
+ * PATH resolution cache, maps a command name to the absolute path execv needs.
+ * Entries are filled lazily on lookup. The table is flushed whenever $PATH
+ * changes or inotify reports a change in one of the PATH directories, so a
+ * cached path is always the one a fresh search would find.
+ */
+struct path_entry
+{
+    char *name;
+    char *path;
+    unsigned long hits;
+};
+
+struct path_cache
+{
+    struct path_entry *slots; // open addressing with linear probing
+    int capacity;             // always a power of two
+    int count;
+    char *path_env;  // $PATH the cache was built for
+    int inotify_fd;  // watches every PATH directory, -1 if unavailable
+    unsigned generation; // bumped on every flush
+};
+
+static struct path_cache path_cache = {NULL, 0, 0, NULL, -1, 0};
+
+/**
+ * FNV-1a hash of a NUL-terminated string
+ * @param  str [description]
+ * @return     hash value
+ */
+static unsigned long hash_string(const char *str)
+{
+    unsigned long h = 1469598103934665603UL;
+    while (*str)
+    {
+        h ^= (unsigned char)*str++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/**
+ * Drop every cached entry and re-arm the directory watches for $PATH
+ */
+void path_cache_reset()
+{
+    for (int i = 0; i < path_cache.capacity; i++)
+    {
+        free(path_cache.slots[i].name);
+        free(path_cache.slots[i].path);
+    }
+    free(path_cache.slots);
+    path_cache.slots = NULL;
+    path_cache.capacity = 0;
+    path_cache.count = 0;
+    path_cache.generation++;
+
+    free(path_cache.path_env);
+    const char *path_env = getenv("PATH");
+    path_cache.path_env = strdup(path_env ? path_env : "");
+
+    // a fresh inotify instance drops the watches of the old PATH
+    if (path_cache.inotify_fd != -1)
+        close(path_cache.inotify_fd);
+    path_cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (path_cache.inotify_fd == -1)
+        return;
+
+    char *dirs = strdup(path_cache.path_env);
+    char *rest = dirs, *dir;
+    while ((dir = strsep(&rest, ":")) != NULL)
+        inotify_add_watch(path_cache.inotify_fd, dir[0] ? dir : ".",
+                          IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM |
+                              IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    free(dirs);
+}
+
+/**
+ * Flush the cache if $PATH or one of its directories changed since it was built
+ */
+static void path_cache_validate()
+{
+    const char *path_env = getenv("PATH");
+    if (path_cache.path_env == NULL ||
+        strcmp(path_cache.path_env, path_env ? path_env : "") != 0)
+    {
+        path_cache_reset();
+        return;
+    }
+    if (path_cache.inotify_fd == -1)
+        return;
+
+    // a single non-blocking read, EAGAIN when nothing changed
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    while (read(path_cache.inotify_fd, events, sizeof(events)) > 0)
+        changed = true;
+    if (changed)
+        path_cache_reset();
+}
+
+/**
+ * Flush the cache after a change of directory if $PATH has a relative
+ * directory, an empty one included: its hits and its watch are for the
+ * directory the shell was in
+ */
+void path_cache_chdir()
+{
+    if (path_cache.path_env == NULL)
+        return;
+    char *dirs = strdup(path_cache.path_env);
+    char *rest = dirs, *dir;
+    bool relative = false;
+    while (!relative && (dir = strsep(&rest, ":")) != NULL)
+        relative = dir[0] != '/';
+    free(dirs);
+    if (relative)
+        path_cache_reset();
+}
+
+/**
+ * Search the $PATH directories for an executable
+ * @param  name command name without a slash
+ * @return      malloc'ed absolute path or NULL
+ */
+static char *path_search(const char *name)
+{
+    char *dirs = strdup(path_cache.path_env);
+    char *rest = dirs, *dir, *found = NULL;
+    struct stat st;
+    while (found == NULL && (dir = strsep(&rest, ":")) != NULL)
+    {
+        char *candidate;
+        if (asprintf(&candidate, "%s/%s", dir[0] ? dir : ".", name) == -1)
+            break;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(candidate, X_OK) == 0)
+            found = candidate;
+        else
+            free(candidate);
+    }
+    free(dirs);
+    return found;
+}
+
+/**
+ * Find the slot of a name, or the empty slot it should go to
+ * @param  name [description]
+ * @return      slot pointer
+ */
+static struct path_entry *path_cache_slot(const char *name)
+{
+    int mask = path_cache.capacity - 1;
+    int i = hash_string(name) & mask;
+    while (path_cache.slots[i].name && strcmp(path_cache.slots[i].name, name))
+        i = (i + 1) & mask;
+    return &path_cache.slots[i];
+}
+
+/**
+ * Insert a resolved path, growing the table at 50% load
+ * @param name [description]
+ * @param path malloc'ed path, owned by the cache afterwards
+ * @return     cached entry
+ */
+static struct path_entry *path_cache_insert(const char *name, char *path)
+{
+    if (2 * (path_cache.count + 1) > path_cache.capacity)
+    {
+        struct path_entry *old = path_cache.slots;
+        int old_capacity = path_cache.capacity;
+        path_cache.capacity = old_capacity ? old_capacity * 2 : 64;
+        path_cache.slots = calloc(path_cache.capacity, sizeof(struct path_entry));
+        for (int i = 0; i < old_capacity; i++)
+            if (old[i].name)
+                *path_cache_slot(old[i].name) = old[i];
+        free(old);
+    }
+    struct path_entry *entry = path_cache_slot(name);
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->hits = 0;
+    path_cache.count++;
+    return entry;
+}
+
+/**
+ * Resolve a command name to the path to execute
+ * @param  name [description]
+ * @return      path owned by the cache (or name itself if it has a slash),
+ *              NULL if the command could not be found
+ */
+const char *resolve_command(const char *name)
+{
+    if (strchr(name, '/'))
+        return name;
+    path_cache_validate();
+    if (path_cache.capacity)
+    {
+        struct path_entry *entry = path_cache_slot(name);
+        if (entry->name)
+        {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+    char *path = path_search(name);
+    if (path == NULL)
+        return NULL;
+    struct path_entry *entry = path_cache_insert(name, path);
+    entry->hits++;
+    return entry->path;
+}
+
+/**
+ * hash builtin: list the cache, reset it with -r, or remember given names
+ * @param  command [description]
+ * @return         SUCCESS
+ */
+int builtin_hash(struct command_t *command)
+{
+    path_cache_validate();
+    if (command->arg_count == 0)
+    {
+        if (path_cache.count == 0)
+        {
+            printf("%s: hash table empty\n", sysname);
+            return SUCCESS;
+        }
+        printf("hits\tcommand\n");
+        for (int i = 0; i < path_cache.capacity; i++)
+            if (path_cache.slots[i].name)
+                printf("%4lu\t%s\n", path_cache.slots[i].hits,
+                       path_cache.slots[i].path);
+        return SUCCESS;
+    }
+    for (int i = 0; i < command->arg_count; i++)
+    {
+        if (strcmp(command->args[i], "-r") == 0)
+        {
+            path_cache_reset();
+            continue;
+        }
+        const char *path = resolve_command(command->args[i]);
+        if (path == NULL)
+            printf("-%s: hash: %s: not found\n", sysname, command->args[i]);
+        else if (path != command->args[i])
+            path_cache_slot(command->args[i])->hits = 0; // remembered, not run
+    }
+    return SUCCESS;
+}
+
+/**
+ * Tab completion. Command names come from a trie of the builtins and every
+ * executable on $PATH, rebuilt only when the PATH cache is flushed. File names
+ * come from sorted directory listings, cached per directory and reread only
+ * when the directory's mtime changes.
+ */
+#define COMPLETION_LIST_MAX 100 // candidates kept for listing
+#define DIR_CACHE_SIZE 8
+
+const char *builtin_names[] = {"bg", "cd", "exit", "fg", "hash", "jobs", "launcher",
+                               "memstat", "pipestatus", "set", "stats", "time",
+                               "uniq", "wait", "wiseman"};
+
+struct trie_node
+{
+    char c;
+    bool terminal;    // a name ends here
+    uint32_t child;   // first child, 0 for none (node 0 is the root)
+    uint32_t sibling; // next child of the same parent, sorted by c
+};
+
+struct command_trie
+{
+    struct trie_node *nodes;
+    uint32_t count, capacity;
+    unsigned generation; // of the PATH cache it was built from
+};
+static struct command_trie command_trie;
+
+struct completion
+{
+    struct strbuf names; // NUL separated, at most COMPLETION_LIST_MAX of them
+    size_t count;        // every candidate, listed or not
+    struct strbuf common; // longest common prefix of the candidates
+};
+
+static uint32_t trie_child(uint32_t node, char c, bool create)
+{
+    if (create && command_trie.count == command_trie.capacity)
+    {
+        command_trie.capacity *= 2;
+        command_trie.nodes = realloc(command_trie.nodes,
+                                     command_trie.capacity * sizeof(struct trie_node));
+    }
+    uint32_t *link = &command_trie.nodes[node].child;
+    while (*link && command_trie.nodes[*link].c < c)
+        link = &command_trie.nodes[*link].sibling;
+    if (*link && command_trie.nodes[*link].c == c)
+        return *link;
+    if (!create)
+        return 0;
+    uint32_t fresh = command_trie.count++;
+    command_trie.nodes[fresh] = (struct trie_node){c, false, 0, *link};
+    *link = fresh;
+    return fresh;
+}
+
+static void trie_insert(const char *name)
+{
+    uint32_t node = 0;
+    for (; *name; name++)
+        node = trie_child(node, *name, true);
+    command_trie.nodes[node].terminal = true;
+}
+
+static void command_trie_build()
+{
+    if (command_trie.nodes == NULL)
+    {
+        command_trie.capacity = 1024;
+        command_trie.nodes = malloc(command_trie.capacity * sizeof(struct trie_node));
+    }
+    command_trie.count = 1;
+    command_trie.nodes[0] = (struct trie_node){0};
+    for (size_t i = 0; i < sizeof(builtin_names) / sizeof(builtin_names[0]); i++)
+        trie_insert(builtin_names[i]);
+
+    char *dirs = strdup(path_cache.path_env);
+    char *rest = dirs, *dir;
+    while ((dir = strsep(&rest, ":")) != NULL)
+    {
+        DIR *d = opendir(dir[0] ? dir : ".");
+        if (d == NULL)
+            continue;
+        struct dirent *ent;
+        struct stat st;
+        while ((ent = readdir(d)) != NULL)
+        {
+            if (ent->d_name[0] == '.' || ent->d_type == DT_DIR)
+                continue;
+            if (fstatat(dirfd(d), ent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+                (st.st_mode & 0111))
+                trie_insert(ent->d_name);
+        }
+        closedir(d);
+    }
+    free(dirs);
+    command_trie.generation = path_cache.generation;
+}
+
+static void trie_collect(uint32_t node, struct strbuf *name, struct completion *out)
+{
+    if (command_trie.nodes[node].terminal && out->count++ < COMPLETION_LIST_MAX)
+    {
+        strbuf_append(&out->names, name->data, name->len);
+        strbuf_append(&out->names, "", 1);
+    }
+    for (uint32_t c = command_trie.nodes[node].child; c; c = command_trie.nodes[c].sibling)
+    {
+        strbuf_append(name, &command_trie.nodes[c].c, 1);
+        trie_collect(c, name, out);
+        name->len--;
+    }
+}
+
+static void complete_command(const char *prefix, size_t len, struct completion *out)
+{
+    path_cache_validate();
+    if (command_trie.nodes == NULL || command_trie.generation != path_cache.generation)
+        command_trie_build();
+
+    uint32_t node = 0;
+    for (size_t i = 0; i < len && (node = trie_child(node, prefix[i], false)); i++)
+        ;
+    if (node == 0 && len > 0)
+        return;
+    struct strbuf name = {0};
+    strbuf_append(&name, prefix, len);
+    trie_collect(node, &name, out);
+    free(name.data);
+
+    // follow the only way down for as long as there is one
+    strbuf_append(&out->common, prefix, len);
+    while (!command_trie.nodes[node].terminal && command_trie.nodes[node].child &&
+           !command_trie.nodes[command_trie.nodes[node].child].sibling)
+    {
+        node = command_trie.nodes[node].child;
+        strbuf_append(&out->common, &command_trie.nodes[node].c, 1);
+    }
+}
+
+struct dir_listing
+{
+    char *path; // absolute
+    struct timespec mtime;
+    struct strbuf pool; // NUL terminated names, a directory's ends in a slash
+    uint32_t *names;    // offsets into pool, sorted
+    size_t count;
+    unsigned long last_used;
+};
+static struct dir_listing dir_cache[DIR_CACHE_SIZE];
+static unsigned long dir_cache_clock;
+
+static int compare_names(const void *a, const void *b, void *pool)
+{
+    return strcmp((char *)pool + *(uint32_t *)a, (char *)pool + *(uint32_t *)b);
+}
+
+/**
+ * Sorted listing of a directory, from the cache unless it changed
+ * @param  path absolute path
+ * @return      NULL if it can not be read
+ */
+static struct dir_listing *dir_listing(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+    struct dir_listing *listing = &dir_cache[0];
+    for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+        if (dir_cache[i].path && strcmp(dir_cache[i].path, path) == 0)
+        {
+            listing = &dir_cache[i];
+            break;
+        }
+        if (dir_cache[i].last_used < listing->last_used)
+            listing = &dir_cache[i]; // least recently used
+    }
+    listing->last_used = ++dir_cache_clock;
+    if (listing->path && strcmp(listing->path, path) == 0 &&
+        listing->mtime.tv_sec == st.st_mtim.tv_sec &&
+        listing->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return listing;
+
+    DIR *d = opendir(path);
+    if (d == NULL)
+        return NULL;
+    free(listing->path);
+    listing->path = strdup(path);
+    listing->mtime = st.st_mtim;
+    listing->pool.len = 0;
+    listing->count = 0;
+    size_t capacity = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        bool is_dir = ent->d_type == DT_DIR;
+        if (ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN)
+            is_dir = fstatat(dirfd(d), ent->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        if (listing->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            listing->names = realloc(listing->names, capacity * sizeof(uint32_t));
+        }
+        listing->names[listing->count++] = listing->pool.len;
+        strbuf_append(&listing->pool, ent->d_name, strlen(ent->d_name));
+        strbuf_append(&listing->pool, is_dir ? "/" : "", is_dir ? 2 : 1); // and the NUL
+    }
+    closedir(d);
+    qsort_r(listing->names, listing->count, sizeof(uint32_t), compare_names,
+            listing->pool.data);
+    return listing;
+}
+
+static void complete_file(const char *word, size_t len, struct completion *out)
+{
+    const char *slash = memrchr(word, '/', len);
+    size_t dir_len = slash ? slash - word + 1 : 0;
+    const char *base = word + dir_len;
+    size_t base_len = len - dir_len;
+
+    char path[PATH_MAX];
+    const char *home = getenv("HOME");
+    int n;
+    if (dir_len > 0 && word[0] == '/')
+        n = snprintf(path, sizeof(path), "%.*s", (int)dir_len, word);
+    else if (dir_len > 1 && word[0] == '~' && word[1] == '/' && home)
+        n = snprintf(path, sizeof(path), "%s%.*s", home, (int)dir_len - 1, word + 1);
+    else
+        n = snprintf(path, sizeof(path), "%s/%.*s", prompt_cache.cwd, (int)dir_len, word);
+    struct dir_listing *listing = n < (int)sizeof(path) ? dir_listing(path) : NULL;
+    if (listing == NULL)
+        return;
+
+    // the names with the prefix are a range of the sorted listing
+    size_t lo = 0, hi = listing->count;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (strncmp(listing->pool.data + listing->names[mid], base, base_len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    size_t common = 0;
+    const char *first = NULL;
+    for (; lo < listing->count; lo++)
+    {
+        const char *name = listing->pool.data + listing->names[lo];
+        if (strncmp(name, base, base_len) != 0)
+            break;
+        if (name[0] == '.' && (base_len == 0 || base[0] != '.'))
+            continue; // hidden unless asked for
+        if (first == NULL)
+            common = strlen(first = name);
+        while (common > 0 && strncmp(first, name, common) != 0)
+            common--;
+        if (out->count++ < COMPLETION_LIST_MAX)
+            strbuf_append(&out->names, name, strlen(name) + 1);
+    }
+    if (first != NULL)
+    {
+        strbuf_append(&out->common, word, dir_len);
+        strbuf_append(&out->common, first, common);
+    }
+}
+
+/**
+ * Find the completions of a word
+ * @param word    unquoted word
+ * @param len     [description]
+ * @param command true if the word is in command position
+ * @param out     cleared first
+ */
+void complete_word(const char *word, size_t len, bool command, struct completion *out)
+{
+    out->names.len = out->common.len = 0;
+    out->count = 0;
+    if (command && memchr(word, '/', len) == NULL)
+        complete_command(word, len, out);
+    else
+        complete_file(word, len, out);
+}
+
+/**
+ * Print the candidates in columns
+ * @param out  [description]
+ * @param cols terminal width
+ */
+void print_completions(struct completion *out, int cols)
+{
+    size_t width = 0, listed = out->count < COMPLETION_LIST_MAX ? out->count : COMPLETION_LIST_MAX;
+    for (const char *name = out->names.data; name < out->names.data + out->names.len;
+         name += strlen(name) + 1)
+        if (strlen(name) + 2 > width)
+            width = strlen(name) + 2;
+    size_t per_row = width < (size_t)cols ? cols / width : 1;
+    size_t i = 0;
+    for (const char *name = out->names.data; i < listed; name += strlen(name) + 1, i++)
+        printf("%-*s%s", (int)width, name, (i + 1) % per_row == 0 || i + 1 == listed ? "\n" : "");
+    if (out->count > listed)
+        printf("... and %zu more\n", out->count - listed);
+}
+
+// a byte that ends the word before it, unless escaped
+static bool word_delimiter(struct line_editor *ed, size_t at)
+{
+    char c = ed->line.data[at];
+    if (c != ' ' && c != '\t' && c != '|' && c != '&' && c != '<' && c != '>')
+        return false;
+    return at == 0 || ed->line.data[at - 1] != '\\';
+}
+
+static void editor_insert_escaped(struct line_editor *ed, const char *text, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (strchr(" \t'\"\\|&<>", text[i]))
+            strbuf_insert(&ed->line, ed->cursor++, "\\", 1);
+        strbuf_insert(&ed->line, ed->cursor++, text + i, 1);
+    }
+}
+
+/**
+ * Complete the word before the cursor as far as its candidates agree, list
+ * them when they agree no further
+ * @param ed [description]
+ */
+void editor_complete(struct line_editor *ed)
+{
+    static struct completion out;
+    size_t start = ed->cursor;
+    while (start > 0 && !word_delimiter(ed, start - 1))
+        start--;
+    // in command position if only blanks separate it from a | or &
+    size_t before = start;
+    while (before > 0 && (ed->line.data[before - 1] == ' ' || ed->line.data[before - 1] == '\t'))
+        before--;
+    bool command = before == 0 || ed->line.data[before - 1] == '|' ||
+                   ed->line.data[before - 1] == '&';
+
+    char *word = malloc(ed->cursor - start + 1);
+    size_t len = 0;
+    for (size_t i = start; i < ed->cursor; i++)
+    {
+        if (ed->line.data[i] == '\\' && i + 1 < ed->cursor)
+            i++;
+        word[len++] = ed->line.data[i];
+    }
+    complete_word(word, len, command, &out);
+    free(word);
+
+    if (out.count == 0)
+    {
+        write_all(STDOUT_FILENO, "\a", 1);
+        return;
+    }
+    editor_insert_escaped(ed, out.common.data + len, out.common.len - len);
+    if (out.count == 1)
+    {
+        if (out.common.data[out.common.len - 1] != '/')
+            strbuf_insert(&ed->line, ed->cursor++, " ", 1);
+    }
+    else if (out.common.len == len)
+    {
+        // list below the line, the next frame starts after the list
+        size_t cursor = ed->cursor;
+        ed->cursor = ed->line.len;
+        editor_render(ed);
+        ed->cursor = cursor;
+        printf("\n");
+        print_completions(&out, ed->cols);
+        ed->cursor_row = 0;
+    }
+}
+
+/**
+ * Backend used to start external commands, switchable at runtime with the
+ * launcher builtin or the SHELLAX_LAUNCHER environment variable so both can be
+ * timed on the same workload. Builtins always run in a forked child.
+ */
+typedef enum
+{
+    LAUNCH_FORK = 0, // fork, set up fds in the child, then execv
+    LAUNCH_SPAWN,    // posix_spawn (vfork-style clone) with file actions
+} LAUNCHER;
+
+// terminal the shell controls, false when stdin is not a tty
+bool interactive = false;
+pid_t shell_pgid;
+
+const char *launcher_names[] = {"fork", "spawn"};
+LAUNCHER launcher = LAUNCH_SPAWN;
+
+// set while the stages of a foreground job start: the first one takes the
+// terminal for the job's process group before it execs, so no stage can read
+// it before it is theirs
+bool launch_foreground = false;
+
+/**
+ * Select the launch backend by name
+ * @param  name "fork" or "spawn"
+ * @return      0 on success, -1 for an unknown name
+ */
+int set_launcher(const char *name)
+{
+    for (int i = 0; i <= LAUNCH_SPAWN; i++)
+    {
+        if (strcmp(name, launcher_names[i]) == 0)
+        {
+            launcher = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * launcher builtin: print the launch backend, or switch it
+ * @param  command [description]
+ * @return         SUCCESS
+ */
+int builtin_launcher(struct command_t *command)
+{
+    if (command->arg_count == 0)
+        printf("%s\n", launcher_names[launcher]);
+    else if (set_launcher(command->args[0]) == -1)
+        printf("-%s: launcher: %s: expected fork or spawn\n", sysname,
+               command->args[0]);
+    return SUCCESS;
+}
+
+/**
+ * What a child does to its fds for one redirect: dup2(source, fd), or
+ * close(fd) when source is -1. The sources of files and here-documents are
+ * opened by the shell, close-on-exec, and are owned by the action.
+ */
+struct fd_action
+{
+    int fd;
+    int source;
+    bool owned;
+};
+
+/**
+ * Put a here-document or here-string into an anonymous memory file, so it
+ * never touches the disk and can be read like any file
+ * @param  data    [description]
+ * @param  len     [description]
+ * @param  newline append a newline, here-strings end with one
+ * @return         fd positioned at the start, -1 on failure
+ */
+static int memfd_document(const char *data, size_t len, bool newline)
+{
+    int fd = memfd_create("shellax-heredoc", MFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (write_all(fd, data, len) == -1 || (newline && write_all(fd, "\n", 1) == -1) ||
+        lseek(fd, 0, SEEK_SET) == -1)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Close the fds a list of actions owns
+ * @param actions [description]
+ * @param count   [description]
+ */
+void redirect_release(struct fd_action *actions, int count)
+{
+    for (int i = 0; i < count; i++)
+        if (actions[i].owned)
+            close(actions[i].source);
+}
+
+/**
+ * Open what the redirects of a command need, in the order given, and turn
+ * them into the fd actions a child applies. Opening in the shell means a
+ * redirect that fails stops the stage before it starts, and every launcher
+ * shares the same setup.
+ * @param  command [description]
+ * @param  actions set to the actions, arena allocated
+ * @return         number of actions, -1 if a redirect failed (with a message)
+ */
+int redirect_prepare(struct command_t *command, struct fd_action **actions)
+{
+    int count = 0, max_fd = STDERR_FILENO;
+    for (struct redirect *r = command->redirects; r; r = r->next, count++)
+        if (r->fd > max_fd)
+            max_fd = r->fd;
+    *actions = arena_alloc(&command_arena, count * sizeof(struct fd_action) + 1);
+
+    int n = 0;
+    for (struct redirect *r = command->redirects; r; r = r->next, n++)
+    {
+        struct fd_action *action = &(*actions)[n];
+        action->fd = r->fd;
+        int source;
+        switch (r->type)
+        {
+        case REDIRECT_DUP:
+            action->source = r->source;
+            continue;
+        case REDIRECT_READ:
+            source = open(r->target, O_RDONLY | O_CLOEXEC);
+            break;
+        case REDIRECT_WRITE:
+            source = open(r->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            break;
+        case REDIRECT_APPEND:
+            source = open(r->target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            break;
+        case REDIRECT_READ_WRITE:
+            source = open(r->target, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            break;
+        case REDIRECT_HEREDOC:
+            source = memfd_document(r->target, r->length, false);
+            break;
+        default: // REDIRECT_HERESTRING
+            source = memfd_document(r->target, strlen(r->target), true);
+            break;
+        }
+        // keep it clear of the fds the actions set up, a dup2 must never
+        // land on the source of a later one
+        if (source != -1 && source <= max_fd)
+        {
+            int moved = fcntl(source, F_DUPFD_CLOEXEC, max_fd + 1);
+            close(source);
+            source = moved;
+        }
+        if (source == -1)
+        {
+            fprintf(stderr, "-%s: %s: %s\n", sysname,
+                    r->type == REDIRECT_HEREDOC ? "here-document" : r->target,
+                    strerror(errno));
+            redirect_release(*actions, n);
+            return -1;
+        }
+        action->source = source;
+        action->owned = true;
+    }
+    return count;
+}
+
+/**
+ * Carry out redirect actions on the fds of a forked child
+ * @param  actions [description]
+ * @param  count   [description]
+ * @return         0, -1 if an fd to copy was not open (with a message)
+ */
+int redirect_apply(struct fd_action *actions, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (actions[i].source == -1)
+            close(actions[i].fd);
+        else if (dup2(actions[i].source, actions[i].fd) == -1)
+        {
+            fprintf(stderr, "-%s: %d: %s\n", sysname, actions[i].source, strerror(errno));
+            return -1;
+        }
+    }
+    // a builtin run in the child never execs, close-on-exec won't do it
+    redirect_release(actions, count);
+    return 0;
+}
+
+/**
+ * Signals whose disposition the shell changes for job control. Children get
+ * them back at their default disposition.
+ * @param set [description]
+ */
+void job_control_signals(sigset_t *set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGQUIT);
+    sigaddset(set, SIGTSTP);
+    sigaddset(set, SIGTTOU);
+    sigaddset(set, SIGTTIN);
+    sigaddset(set, SIGCHLD);
+    sigaddset(set, SIGPIPE); // builtin threads get EPIPE instead of killing us
+}
+
+/**
+ * Start an external command with posix_spawn. The fd setup the forked child
+ * would do is expressed as file actions, so the shell's pages are never
+ * copied. Pipe fds are close-on-exec, so only the dup'ed copies survive.
+ * @param  command   command with its exec-ready argument vector
+ * @param  exec_path resolved path of the executable
+ * @param  in_fd     fd to use as stdin, -1 to inherit
+ * @param  out_fd    fd to use as stdout, -1 to inherit
+ * @param  pgid      process group to join, 0 to lead a new one
+ * @param  redirects from redirect_prepare
+ * @param  count     number of redirects
+ * @return           child pid, -1 on failure
+ */
+pid_t spawn_command(struct command_t *command, const char *exec_path, int in_fd,
+                    int out_fd, pid_t pgid, struct fd_action *redirects, int count)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    // while stdin is still the terminal: the leader may read a pipe, when a
+    // builtin before it runs on a thread, or a redirect
+    if (interactive && launch_foreground && pgid == 0)
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    if (in_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    // redirects come after the pipes, so they take precedence
+    for (int i = 0; i < count; i++)
+    {
+        if (redirects[i].source == -1)
+            posix_spawn_file_actions_addclose(&actions, redirects[i].fd);
+        else
+            posix_spawn_file_actions_adddup2(&actions, redirects[i].source, redirects[i].fd);
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults;
+    job_control_signals(&defaults);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    sigset_t no_signals; // SIGCHLD is blocked while a pipeline starts
+    sigemptyset(&no_signals);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF |
+                                        POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    int r = posix_spawn(&pid, exec_path, &actions, &attr, command->args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (r != 0)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(r));
+        return -1;
+    }
+    // posix_spawn returns once the child has exec'ed
+    if (tracing())
+        trace_event("exec", 'i', trace.track, trace_clock(), 0, exec_path);
+    return pid;
+}
+
+/**
+ * Buffered writer on a raw fd, so builtins can write to whatever fd they were
+ * handed instead of going through stdout
+ */
+struct out_buf
+{
+    int fd;
+    size_t len;
+    char data[1 << 16];
+};
+
+/**
+ * Write a whole buffer to an fd, retrying short writes
+ * @param  fd   [description]
+ * @param  data [description]
+ * @param  len  [description]
+ * @return      0 on success, -1 on a write error
+ */
+int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Write everything pending in the buffer
+ * @param  out [description]
+ * @return     0 on success, -1 on a write error
+ */
+int out_flush(struct out_buf *out)
+{
+    size_t len = out->len;
+    out->len = 0;
+    return write_all(out->fd, out->data, len);
+}
+
+/**
+ * Append bytes to the buffer, flushing when it fills up
+ * @param  out  [description]
+ * @param  data [description]
+ * @param  len  [description]
+ * @return      0 on success, -1 on a write error
+ */
+int out_write(struct out_buf *out, const char *data, size_t len)
+{
+    if (out->len + len > sizeof(out->data))
+    {
+        if (out_flush(out) == -1)
+            return -1;
+        if (len > sizeof(out->data)) // large writes go straight to the fd
+            return write_all(out->fd, data, len);
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+/**
+ * Hash a byte range, 8 bytes per step
+ * @param  data [description]
+ * @param  len  [description]
+ * @param  seed different seeds give independent hashes
+ * @return      64-bit hash
+ */
+uint64_t hash_bytes(const char *data, size_t len, uint64_t seed)
+{
+    const uint64_t m = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = seed ^ (len * m), k;
+    while (len >= 8)
+    {
+        memcpy(&k, data, 8);
+        h ^= k * 0xff51afd7ed558ccdULL;
+        h = ((h << 27) | (h >> 37)) * m;
+        data += 8;
+        len -= 8;
+    }
+    k = 0;
+    memcpy(&k, data, len);
+    h ^= k * 0xc4ceb9fe1a85ec53ULL;
+    // murmur3 finalizer
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Distinct lines seen by uniq, kept in first-seen order. The bytes of every
+ * line live in one pool, and an open-addressing table of entry indices finds
+ * duplicates in O(1), so memory grows with the distinct lines only.
+ */
+struct uniq_entry
+{
+    uint64_t hash;
+    size_t offset; // into pool, offsets survive the pool being realloc'ed
+    size_t len;
+    unsigned long count;
+    uint64_t first_seen; // input line number of the first occurrence
+};
+
+struct uniq_table
+{
+    struct uniq_entry *entries; // first-seen order
+    size_t entry_count, entry_capacity;
+    uint32_t *slots; // entry index + 1, 0 marks an empty slot
+    size_t slot_capacity; // power of two
+    char *pool;
+    size_t pool_len, pool_capacity;
+};
+
+/**
+ * Release everything the table holds and make it empty again
+ * @param table [description]
+ */
+void uniq_table_free(struct uniq_table *table)
+{
+    free(table->entries);
+    free(table->slots);
+    free(table->pool);
+    memset(table, 0, sizeof(*table));
+}
+
+/**
+ * Double the slot array and re-insert every entry
+ * @param table [description]
+ */
+static void uniq_table_grow(struct uniq_table *table)
+{
+    free(table->slots);
+    table->slot_capacity = table->slot_capacity ? table->slot_capacity * 2 : 1024;
+    table->slots = calloc(table->slot_capacity, sizeof(uint32_t));
+    size_t mask = table->slot_capacity - 1;
+    for (size_t e = 0; e < table->entry_count; e++)
+    {
+        size_t i = table->entries[e].hash & mask;
+        while (table->slots[i])
+            i = (i + 1) & mask;
+        table->slots[i] = e + 1;
+    }
+}
+
+/**
+ * Look a line up, adding it with a zero count if it is new
+ * @param  table [description]
+ * @param  line  [description]
+ * @param  len   [description]
+ * @param  added set to whether the line was new
+ * @return       the entry of the line
+ */
+struct uniq_entry *uniq_table_add(struct uniq_table *table, const char *line,
+                                  size_t len, bool *added)
+{
+    uint64_t hash = hash_bytes(line, len, 0);
+    if (2 * (table->entry_count + 1) > table->slot_capacity)
+        uniq_table_grow(table);
+
+    size_t mask = table->slot_capacity - 1;
+    size_t i = hash & mask;
+    while (table->slots[i])
+    {
+        struct uniq_entry *entry = &table->entries[table->slots[i] - 1];
+        if (entry->hash == hash && entry->len == len &&
+            memcmp(table->pool + entry->offset, line, len) == 0)
+        {
+            *added = false;
+            return entry;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if (table->entry_count == table->entry_capacity)
+    {
+        table->entry_capacity = table->entry_capacity ? table->entry_capacity * 2 : 1024;
+        table->entries = realloc(table->entries,
+                                 table->entry_capacity * sizeof(struct uniq_entry));
+    }
+    if (table->pool_len + len > table->pool_capacity)
+    {
+        while (table->pool_len + len > table->pool_capacity)
+            table->pool_capacity = table->pool_capacity ? table->pool_capacity * 2 : 1 << 16;
+        table->pool = realloc(table->pool, table->pool_capacity);
+    }
+    memcpy(table->pool + table->pool_len, line, len);
+
+    struct uniq_entry *entry = &table->entries[table->entry_count];
+    entry->hash = hash;
+    entry->offset = table->pool_len;
+    entry->len = len;
+    entry->count = 0;
+    entry->first_seen = 0;
+    table->pool_len += len;
+    table->slots[i] = ++table->entry_count;
+    *added = true;
+    return entry;
+}
+
+/**
+ * Heap memory held by a table, checked against the --mem-limit budget
+ * @param  table [description]
+ * @return       bytes
+ */
+size_t uniq_table_bytes(struct uniq_table *table)
+{
+    return table->entry_capacity * sizeof(struct uniq_entry) +
+           table->slot_capacity * sizeof(uint32_t) + table->pool_capacity;
+}
+
+/**
+ * Write one output line of uniq, in the same format as always
+ * @param  out   [description]
+ * @param  line  [description]
+ * @param  len   [description]
+ * @param  count occurrences, printed in --count mode
+ * @param  show_count [description]
+ * @return       0 on success, -1 on a write error
+ */
+int uniq_print(struct out_buf *out, const char *line, size_t len,
+               unsigned long count, bool show_count)
+{
+    char prefix[64];
+    int n;
+    if (show_count)
+        n = snprintf(prefix, sizeof(prefix), "From our uniq count: \t %lu ", count);
+    else
+        n = snprintf(prefix, sizeof(prefix), "From our uniq:\t ");
+    if (out_write(out, prefix, n) == -1 || out_write(out, line, len) == -1)
+        return -1;
+    return out_write(out, "\n", 1);
+}
+
+/**
+ * Split an input stream into lines and hand each to a callback. Input is read
+ * in large chunks and lines are passed as slices of the read buffer.
+ * @param  in_fd [description]
+ * @param  fn    called for every non-empty line
+ * @param  arg   passed through to fn
+ * @return       0 at end of input, -1 on a read or callback error
+ */
+int for_each_line(int in_fd, int (*fn)(const char *, size_t, void *), void *arg)
+{
+    size_t capacity = 1 << 20, len = 0;
+    char *buf = malloc(capacity);
+    int r = 0;
+    while (1)
+    {
+        if (len == capacity) // a single line longer than the buffer
+            buf = realloc(buf, capacity *= 2);
+        ssize_t n = read(in_fd, buf + len, capacity - len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+        {
+            r = -1;
+            break;
+        }
+        if (n == 0)
+        {
+            if (len > 0)
+                r = fn(buf, len, arg);
+            break;
+        }
+        size_t scanned = len; // bytes before it hold no newline
+        len += n;
+        char *start = buf, *end = buf + len, *nl;
+        while ((nl = memchr(buf + scanned, '\n', end - (buf + scanned))) != NULL)
+        {
+            // empty lines are skipped, as the strtok based version did
+            if (nl > start && (r = fn(start, nl - start, arg)) == -1)
+                break;
+            start = nl + 1;
+            scanned = start - buf;
+        }
+        if (r == -1)
+            break;
+        len = end - start;
+        memmove(buf, start, len);
+    }
+    free(buf);
+    return r;
+}
+
+/**
+ * External uniq for inputs whose distinct lines do not fit in memory. When the
+ * table outgrows the --mem-limit budget its entries are written to partition
+ * files chosen by line hash, so every copy of a line lands in the same
+ * partition. Each partition is then deduplicated on its own (split again with
+ * a new hash seed if it is still too large) into a run sorted by first-seen
+ * line number, and the runs are merged by that number. Output and counts are
+ * the same as for the in-memory pass.
+ */
+#define UNIQ_PARTITIONS 64
+#define UNIQ_MAX_DEPTH 3
+
+struct uniq_record
+{
+    uint64_t first_seen;
+    uint64_t count;
+    uint64_t len;
+};
+
+struct uniq_run_cursor
+{
+    FILE *file;
+    struct uniq_record rec;
+    char *line;
+    size_t line_capacity;
+};
+
+struct uniq_input
+{
+    struct uniq_table table;
+    uint64_t line_no;
+    size_t mem_limit; // 0 keeps everything in memory
+    FILE **parts;     // partition files, NULL until the first spill
+};
+
+/**
+ * Create an anonymous temporary file under $TMPDIR
+ * @return stream, NULL on failure
+ */
+static FILE *uniq_tmpfile()
+{
+    const char *dir = getenv("TMPDIR");
+    char *path;
+    if (asprintf(&path, "%s/shellax-uniq-XXXXXX", dir ? dir : "/tmp") == -1)
+        return NULL;
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd != -1)
+        unlink(path); // gone from disk as soon as it is closed
+    free(path);
+    if (fd == -1)
+        return NULL;
+    FILE *file = fdopen(fd, "w+");
+    if (file != NULL)
+        setvbuf(file, NULL, _IOFBF, 1 << 16);
+    return file;
+}
+
+static int uniq_write_record(FILE *file, struct uniq_record *rec, const char *line)
+{
+    if (fwrite(rec, sizeof(*rec), 1, file) != 1 ||
+        fwrite(line, 1, rec->len, file) != rec->len)
+        return -1;
+    return 0;
+}
+
+/**
+ * Read the next record of a partition or run
+ * @return 1 for a record, 0 at end of file, -1 on error
+ */
+static int uniq_read_record(FILE *file, struct uniq_record *rec, char **line,
+                            size_t *line_capacity)
+{
+    if (fread(rec, sizeof(*rec), 1, file) != 1)
+        return ferror(file) ? -1 : 0;
+    if (rec->len > *line_capacity)
+    {
+        *line_capacity = rec->len;
+        *line = realloc(*line, *line_capacity);
+    }
+    if (fread(*line, 1, rec->len, file) != rec->len)
+        return -1;
+    return 1;
+}
+
+static FILE **uniq_open_parts()
+{
+    FILE **parts = calloc(UNIQ_PARTITIONS, sizeof(FILE *));
+    for (int p = 0; p < UNIQ_PARTITIONS; p++)
+    {
+        if ((parts[p] = uniq_tmpfile()) == NULL)
+        {
+            while (p--)
+                fclose(parts[p]);
+            free(parts);
+            return NULL;
+        }
+    }
+    return parts;
+}
+
+static void uniq_close_files(FILE **files, int n)
+{
+    for (int i = 0; i < n; i++)
+        if (files[i])
+            fclose(files[i]);
+    free(files);
+}
+
+static int uniq_partition_of(const char *line, size_t len, int depth)
+{
+    return hash_bytes(line, len, depth + 1) % UNIQ_PARTITIONS;
+}
+
+/**
+ * Write every entry of a table to the partition files and empty the table
+ * @param  table [description]
+ * @param  parts [description]
+ * @param  depth partitioning level, selects the hash seed
+ * @return       0 on success, -1 on a write error
+ */
+static int uniq_spill(struct uniq_table *table, FILE **parts, int depth)
+{
+    int r = 0;
+    for (size_t e = 0; e < table->entry_count && r == 0; e++)
+    {
+        struct uniq_entry *entry = &table->entries[e];
+        const char *line = table->pool + entry->offset;
+        struct uniq_record rec = {entry->first_seen, entry->count, entry->len};
+        r = uniq_write_record(parts[uniq_partition_of(line, entry->len, depth)],
+                              &rec, line);
+    }
+    uniq_table_free(table);
+    return r;
+}
+
+static int uniq_compare_first_seen(const void *a, const void *b)
+{
+    const struct uniq_entry *x = a, *y = b;
+    return (x->first_seen > y->first_seen) - (x->first_seen < y->first_seen);
+}
+
+static int uniq_merge_runs(FILE **runs, int n, FILE *run_out, struct out_buf *out,
+                           bool show_count);
+
+/**
+ * Deduplicate one partition into a run sorted by first-seen line number
+ * @param  part      partition file
+ * @param  mem_limit [description]
+ * @param  depth     partitioning level of part
+ * @param  run       output run file
+ * @return           0 on success, -1 on error
+ */
+static int uniq_partition_to_run(FILE *part, size_t mem_limit, int depth, FILE *run)
+{
+    struct uniq_table table;
+    memset(&table, 0, sizeof(table));
+    struct uniq_record rec;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    FILE **sub_parts = NULL;
+    int r;
+
+    rewind(part);
+    while ((r = uniq_read_record(part, &rec, &line, &line_capacity)) == 1)
+    {
+        if (sub_parts != NULL) // already over budget, just split the rest
+        {
+            if (uniq_write_record(sub_parts[uniq_partition_of(line, rec.len, depth + 1)],
+                                  &rec, line) == -1)
+                break;
+            continue;
+        }
+        bool added;
+        struct uniq_entry *entry = uniq_table_add(&table, line, rec.len, &added);
+        if (added || rec.first_seen < entry->first_seen)
+            entry->first_seen = rec.first_seen;
+        entry->count += rec.count;
+
+        if (uniq_table_bytes(&table) > mem_limit && depth + 1 < UNIQ_MAX_DEPTH)
+        {
+            if ((sub_parts = uniq_open_parts()) == NULL ||
+                uniq_spill(&table, sub_parts, depth + 1) == -1)
+                break;
+        }
+    }
+    free(line);
+    if (r != 0)
+    {
+        uniq_table_free(&table);
+        if (sub_parts)
+            uniq_close_files(sub_parts, UNIQ_PARTITIONS);
+        return -1;
+    }
+
+    if (sub_parts != NULL)
+    {
+        FILE **sub_runs = calloc(UNIQ_PARTITIONS, sizeof(FILE *));
+        for (int p = 0; p < UNIQ_PARTITIONS && r == 0; p++)
+        {
+            if ((sub_runs[p] = uniq_tmpfile()) == NULL ||
+                uniq_partition_to_run(sub_parts[p], mem_limit, depth + 1, sub_runs[p]) == -1)
+                r = -1;
+            fclose(sub_parts[p]); // done with it, free the disk space early
+            sub_parts[p] = NULL;
+        }
+        if (r == 0)
+            r = uniq_merge_runs(sub_runs, UNIQ_PARTITIONS, run, NULL, false);
+        uniq_close_files(sub_parts, UNIQ_PARTITIONS);
+        uniq_close_files(sub_runs, UNIQ_PARTITIONS);
+        return r;
+    }
+
+    qsort(table.entries, table.entry_count, sizeof(struct uniq_entry),
+          uniq_compare_first_seen);
+    for (size_t e = 0; e < table.entry_count && r == 0; e++)
+    {
+        struct uniq_entry *entry = &table.entries[e];
+        struct uniq_record out = {entry->first_seen, entry->count, entry->len};
+        r = uniq_write_record(run, &out, table.pool + entry->offset);
+    }
+    uniq_table_free(&table);
+    return r;
+}
+
+static bool uniq_cursor_less(struct uniq_run_cursor *cursors, int a, int b)
+{
+    return cursors[a].rec.first_seen < cursors[b].rec.first_seen;
+}
+
+static void uniq_heap_down(struct uniq_run_cursor *cursors, int *heap, int n, int i)
+{
+    while (1)
+    {
+        int smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && uniq_cursor_less(cursors, heap[l], heap[smallest]))
+            smallest = l;
+        if (r < n && uniq_cursor_less(cursors, heap[r], heap[smallest]))
+            smallest = r;
+        if (smallest == i)
+            return;
+        int tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+/**
+ * Merge sorted runs by first-seen line number, either into another run or
+ * into the final uniq output
+ * @param  runs       [description]
+ * @param  n          number of runs
+ * @param  run_out    run to write to, or NULL to print
+ * @param  out        output buffer used when run_out is NULL
+ * @param  show_count [description]
+ * @return            0 on success, -1 on error
+ */
+static int uniq_merge_runs(FILE **runs, int n, FILE *run_out, struct out_buf *out,
+                           bool show_count)
+{
+    struct uniq_run_cursor *cursors = calloc(n, sizeof(struct uniq_run_cursor));
+    int *heap = malloc(n * sizeof(int));
+    int heap_len = 0, r = 0;
+    for (int i = 0; i < n; i++)
+    {
+        cursors[i].file = runs[i];
+        rewind(runs[i]);
+        int got = uniq_read_record(runs[i], &cursors[i].rec, &cursors[i].line,
+                                   &cursors[i].line_capacity);
+        if (got == -1)
+            r = -1;
+        if (got == 1)
+            heap[heap_len++] = i;
+    }
+    for (int i = heap_len / 2 - 1; i >= 0; i--)
+        uniq_heap_down(cursors, heap, heap_len, i);
+
+    while (heap_len > 0 && r == 0)
+    {
+        struct uniq_run_cursor *c = &cursors[heap[0]];
+        if (run_out != NULL)
+            r = uniq_write_record(run_out, &c->rec, c->line);
+        else
+            r = uniq_print(out, c->line, c->rec.len, c->rec.count, show_count);
+        int got = uniq_read_record(c->file, &c->rec, &c->line, &c->line_capacity);
+        if (got == -1)
+            r = -1;
+        if (got != 1)
+            heap[0] = heap[--heap_len];
+        uniq_heap_down(cursors, heap, heap_len, 0);
+    }
+    for (int i = 0; i < n; i++)
+        free(cursors[i].line);
+    free(cursors);
+    free(heap);
+    return r;
+}
+
+static int uniq_add_line(const char *line, size_t len, void *arg)
+{
+    struct uniq_input *input = arg;
+    bool added;
+    struct uniq_entry *entry = uniq_table_add(&input->table, line, len, &added);
+    if (added)
+        entry->first_seen = input->line_no;
+    entry->count++;
+    input->line_no++;
+
+    if (input->mem_limit && uniq_table_bytes(&input->table) > input->mem_limit)
+    {
+        if (input->parts == NULL && (input->parts = uniq_open_parts()) == NULL)
+            return -1;
+        return uniq_spill(&input->table, input->parts, 0);
+    }
+    return 0;
+}
+
+/**
+ * Parse a size with an optional K, M or G suffix
+ * @param  str [description]
+ * @param  size set to the size in bytes
+ * @return     0 on success, -1 if it is not a size
+ */
+static int parse_size(const char *str, size_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno || end == str)
+        return -1;
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        value <<= 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        value <<= 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        value <<= 10;
+        end++;
+        break;
+    }
+    if (*end != 0 || value == 0)
+        return -1;
+    *size = value;
+    return 0;
+}
+
+/**
+ * uniq builtin: print every distinct input line once, in the order it was
+ * first seen, optionally with its number of occurrences (-c, --count).
+ * Streams the input, so time is linear in the input size. With
+ * --mem-limit=SIZE the table spills to temporary files instead of growing
+ * past SIZE bytes.
+ * @param  command command with its exec-ready argument vector
+ * @param  in_fd   [description]
+ * @param  out_fd  [description]
+ * @return         exit status
+ */
+int builtin_uniq(struct command_t *command, int in_fd, int out_fd)
+{
+    bool show_count = false;
+    struct uniq_input input;
+    memset(&input, 0, sizeof(input));
+    for (int i = 1; command->args[i] != NULL; i++)
+    {
+        if (!strcmp(command->args[i], "-c") || !strcmp(command->args[i], "--count"))
+            show_count = true;
+        else if (!strncmp(command->args[i], "--mem-limit=", 12))
+        {
+            // below a megabyte the initial table allocations alone overflow it
+            if (parse_size(command->args[i] + 12, &input.mem_limit) == -1 ||
+                input.mem_limit < (1 << 20))
+            {
+                fprintf(stderr, "-%s: uniq: %s: invalid size, at least 1M\n",
+                        sysname, command->args[i] + 12);
+                return 2;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "-%s: uniq: %s: invalid option\n", sysname,
+                    command->args[i]);
+            return 2;
+        }
+    }
+
+    struct out_buf *out = malloc(sizeof(struct out_buf));
+    out->fd = out_fd;
+    out->len = 0;
+    int r = for_each_line(in_fd, uniq_add_line, &input);
+
+    if (r == 0 && input.parts == NULL)
+    {
+        for (size_t e = 0; e < input.table.entry_count && r == 0; e++)
+        {
+            struct uniq_entry *entry = &input.table.entries[e];
+            r = uniq_print(out, input.table.pool + entry->offset, entry->len,
+                           entry->count, show_count);
+        }
+    }
+    else if (r == 0)
+    {
+        FILE **runs = calloc(UNIQ_PARTITIONS, sizeof(FILE *));
+        r = uniq_spill(&input.table, input.parts, 0);
+        for (int p = 0; p < UNIQ_PARTITIONS && r == 0; p++)
+        {
+            if ((runs[p] = uniq_tmpfile()) == NULL ||
+                uniq_partition_to_run(input.parts[p], input.mem_limit, 0, runs[p]) == -1)
+                r = -1;
+            fclose(input.parts[p]);
+            input.parts[p] = NULL;
+        }
+        if (r == 0)
+            r = uniq_merge_runs(runs, UNIQ_PARTITIONS, NULL, out, show_count);
+        uniq_close_files(runs, UNIQ_PARTITIONS);
+    }
+    if (input.parts != NULL)
+        uniq_close_files(input.parts, UNIQ_PARTITIONS);
+    if (r == 0)
+        r = out_flush(out);
+    if (r != 0 && errno != EPIPE) // a reader that went away is not an error
+        fprintf(stderr, "-%s: uniq: %s\n", sysname, strerror(errno));
+    free(out);
+    uniq_table_free(&input.table);
+    return r == 0 ? 0 : 1;
+}
+
+/**
+ * memstat builtin: show how much the command arena holds and how many heap
+ * calls it made, overall and while parsing the current line
+ * @param  command [description]
+ * @return         SUCCESS
+ */
+int builtin_memstat(struct command_t *command)
+{
+    int chunks = 0;
+    size_t reserved = 0;
+    for (struct arena_chunk *chunk = command_arena.head; chunk; chunk = chunk->next)
+    {
+        chunks++;
+        reserved += chunk->size;
+    }
+    printf("arena: %d chunks, %zu bytes reserved, %zu used, %zu peak\n", chunks,
+           reserved, command_arena.used, command_arena.peak);
+    printf("heap calls: %lu total, %lu this line\n", command_arena.heap_calls,
+           command_arena.heap_calls - command_arena.heap_calls_at_reset);
+    return SUCCESS;
+}
+
+int process_command(struct command_t *command);
+void sigchld_handler(int sig);
+void notify_jobs();
+void reap_jobs();
+extern bool errexit;
+
+struct batch_input
+{
+    const char *pos, *end;
+};
+
+/**
+ * Next line of a script or -c string, for read_heredocs too
+ * @param  arg a struct batch_input
+ * @param  len set to the line length, without its newline
+ * @return     the line, not NUL terminated, NULL at the end of the text
+ */
+static const char *batch_next_line(void *arg, size_t *len)
+{
+    struct batch_input *input = arg;
+    if (input->pos >= input->end)
+        return NULL;
+    const char *line = input->pos;
+    const char *newline = memchr(line, '\n', input->end - line);
+    *len = (newline ? newline : input->end) - line;
+    input->pos = line + *len + 1;
+    return line;
+}
+
+/**
+ * Run a script or -c string line by line, with no prompt and no terminal
+ * handling
+ * @param  text [description]
+ * @param  len  [description]
+ * @return      exit status of the shell
+ */
+int run_batch(const char *text, size_t len)
+{
+    struct batch_input input = {text, text + len};
+    const char *line;
+    size_t line_len;
+    while ((line = batch_next_line(&input, &line_len)) != NULL)
+    {
+        struct command_t *command =
+            arena_alloc(&command_arena, sizeof(struct command_t)); // zeroed
+        // the parsed words point into the line, so it has to live in the arena
+        if (parse_command(arena_strndup(&command_arena, line, line_len), command) == -1)
+            last_status = 2;
+        else
+            read_heredocs(command, batch_next_line, &input);
+        int code = process_command(command);
+        free_command(command);
+        // finished background jobs leave the table, with no notices
+        reap_jobs();
+        if (code == EXIT || (errexit && last_status != 0))
+            break;
+    }
+    reap_jobs();
+    return last_status;
+}
+
+/**
+ * Read all of a file, for batch mode
+ * @param  fd  [description]
+ * @param  len [description]
+ * @return     malloc'ed contents, NULL on a read error
+ */
+char *read_all(int fd, size_t *len)
+{
+    struct stat st;
+    size_t capacity = fstat(fd, &st) == 0 && st.st_size > 0 ? st.st_size + 1 : 1 << 16;
+    char *buf = malloc(capacity);
+    ssize_t n;
+    *len = 0;
+    while ((n = read(fd, buf + *len, capacity - *len)) != 0)
+    {
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+        {
+            free(buf);
+            return NULL;
+        }
+        *len += n;
+        if (*len == capacity)
+            buf = realloc(buf, capacity *= 2);
+    }
+    return buf;
+}
+
+#ifndef SHELLAX_NO_MAIN // benchmarks include this file for its internals
+int main(int argc, char *argv[])
+{
+    // shellax [-e] [-c command | script], batch mode unless it is neither
+    // and stdin is a terminal
+    const char *command_string = NULL, *script = NULL;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
+    {
+        if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc)
+            command_string = argv[++arg];
+        else if (strcmp(argv[arg], "-e") == 0)
+            errexit = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [-e] [-c command | script]\n", sysname);
+            return 2;
+        }
+    }
+    if (command_string == NULL && arg < argc)
+        script = argv[arg];
+    bool batch = command_string || script || !isatty(STDIN_FILENO);
+
+    interactive = !batch;
+    if (interactive)
+    {
+        // the shell takes the terminal back from finished jobs
+        shell_pgid = getpgrp();
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+    }
+    trace_open();
+    prompt_init();
+    if (interactive)
+        history_open();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+    // builtin stages write from threads of the shell, a closed reader must
+    // fail their write instead of killing the shell
+    signal(SIGPIPE, SIG_IGN);
+
+    const char *launcher_env = getenv("SHELLAX_LAUNCHER");
+    if (launcher_env != NULL && set_launcher(launcher_env) == -1)
+        fprintf(stderr, "-%s: SHELLAX_LAUNCHER: %s: expected fork or spawn\n",
+                sysname, launcher_env);
+
+    if (command_string)
+        return run_batch(command_string, strlen(command_string));
+    if (batch)
+    {
+        int fd = script ? open(script, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+        size_t len;
+        char *text = fd == -1 ? NULL : read_all(fd, &len);
+        if (text == NULL)
+        {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, script ? script : "stdin",
+                    strerror(errno));
+            return 127;
+        }
+        if (script)
+            close(fd);
+        int status = run_batch(text, len);
+        free(text);
+        return status;
+    }
+
+    while (1)
+    {
+        notify_jobs();
+        struct command_t *command =
+            arena_alloc(&command_arena, sizeof(struct command_t)); // zeroed
+
+        int code;
+        code = prompt(command);
+        if (code == EXIT)
+            break;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        code = process_command(command);
+        if (code == EXIT)
+            break;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        prompt_cache.last_duration =
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        prompt_refresh();
+
+        free_command(command);
+    }
+
+    term_cooked();
+    printf("\n");
+    return last_status;
+}
+#endif
+/**
+ * wiseman builtin: schedule a fortune to be spoken every N minutes with crontab
+ * @param  command command with its exec-ready argument vector
+ * @param  out_fd  [description]
+ * @return         exit status
+ */
+int builtin_wiseman(struct command_t *command, int out_fd)
+{
+    // find the path of fortune command
+    char *fortune = "/usr/games/fortune";
+    char *fortune_arg[2] = {fortune, NULL};
+    // open pipe
+    int pipefd_e[2];
+    pipe2(pipefd_e, O_CLOEXEC);
+    char read_message[1024] = {0};
+    // Execute fortune and read it's STDOUT using read_message array
+    pid_t pid_wiseman = fork();
+    if (pid_wiseman == 0)
+    {
+        close(pipefd_e[0]);
+        dup2(pipefd_e[1], STDOUT_FILENO);
+        execv(fortune, fortune_arg);
+        _exit(127);
+    }
+    else
+    {
+        waitpid(pid_wiseman, NULL, 0); // other children may be running
+        close(pipefd_e[1]);
+        read(pipefd_e[0], read_message, sizeof(read_message) - 1);
+        close(pipefd_e[0]);
+        dprintf(out_fd, "read message is: %s\n", read_message);
+        // find path of crontab
+        char *cronfile_name = "fortune_cron";
+        char *crontab = "/usr/bin/crontab";
+        char *crontab_args[3] = {crontab, cronfile_name, NULL};
+        char crontab_cmd[2048];
+        // check for wiseman if it has enough arguments
+        if (command->args[1] == NULL)
+        {
+            fprintf(stderr, "Wiseman argument not provided!\n");
+            return UNKNOWN;
+        }
+        // since we add newline for crontab so we delete newline of read_message
+        if (read_message[0] != 0)
+            read_message[strlen(read_message) - 1] = 0;
+        // crontab_cmd is syntax of our cronjob 
+        sprintf(crontab_cmd, "*/%s * * * * DISPLAY=0 espeak \"%s\"\n", command->args[1], read_message);
+        dprintf(out_fd, "%s\n", crontab_cmd);
+        // write cronjob to a file then give as an argument to crontab
+        FILE *file = fopen(cronfile_name, "w");
+        if (file == NULL)
+        {
+            perror("File opening error");
+        }
+        if (fwrite(crontab_cmd, sizeof(char), strlen(crontab_cmd), file) == -1)
+        {
+            perror("Writing error");
+        }
+        fclose(file);
+        // execute crontab
+        pid_t pid_cron = fork();
+        if (pid_cron == 0)
+        {
+            execv(crontab, crontab_args);
+            _exit(127);
+        }
+        else
+        {
+            waitpid(pid_cron, NULL, 0);
+        }
+        remove(cronfile_name);
+        return SUCCESS;
+    }
+}
+
+/**
+ * Run a builtin that can serve as a pipeline stage
+ * @param  command command with its exec-ready argument vector
+ * @param  in_fd   [description]
+ * @param  out_fd  [description]
+ * @return         exit status
+ */
+int run_builtin(struct command_t *command, int in_fd, int out_fd)
+{
+    if (strcmp(command->name, "uniq") == 0)
+        return builtin_uniq(command, in_fd, out_fd);
+    return builtin_wiseman(command, out_fd);
+}
+
+/**
+ * Start a pipeline stage in a forked child. Builtins run in the child itself,
+ * anything else is exec'ed.
+ * @param  command   command with its exec-ready argument vector
+ * @param  exec_path resolved path, NULL for builtins
+ * @param  in_fd     fd to use as stdin, -1 to inherit
+ * @param  out_fd    fd to use as stdout, -1 to inherit
+ * @param  pgid      process group to join, 0 to lead a new one
+ * @param  pipes     every pipe of the pipeline, closed in the child
+ * @param  npipes    [description]
+ * @param  redirects from redirect_prepare
+ * @param  count     number of redirects
+ * @return           child pid, -1 on failure
+ */
+pid_t fork_command(struct command_t *command, const char *exec_path, int in_fd,
+                   int out_fd, pid_t pgid, int (*pipes)[2], int npipes,
+                   struct fd_action *redirects, int count)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        if (pid == -1)
+            fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+        return pid;
+    }
+
+    setpgid(0, pgid);
+    // SIGTTOU is still ignored, as in the shell
+    if (interactive && launch_foreground && pgid == 0)
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    sigset_t defaults;
+    job_control_signals(&defaults);
+    for (int sig = 1; sig < NSIG; sig++)
+        if (sigismember(&defaults, sig) == 1)
+            signal(sig, SIG_DFL);
+    sigset_t no_signals; // SIGCHLD is blocked while a pipeline starts
+    sigemptyset(&no_signals);
+    sigprocmask(SIG_SETMASK, &no_signals, NULL);
+
+    TRACE_START(start);
+    if (in_fd != -1)
+        dup2(in_fd, STDIN_FILENO);
+    if (out_fd != -1)
+        dup2(out_fd, STDOUT_FILENO);
+    // builtins never exec, so close-on-exec does not clean these up. The
+    // shell closed the ends of earlier stages already, and opening this
+    // stage's redirects may have reused their numbers.
+    for (int i = 0; i < 2 * npipes; i++)
+    {
+        int fd = pipes[i / 2][i % 2];
+        bool redirect = false;
+        for (int j = 0; j < count; j++)
+            if (redirects[j].owned && redirects[j].source == fd)
+                redirect = true;
+        if (!redirect)
+            close(fd);
+    }
+    if (redirect_apply(redirects, count) == -1)
+        _exit(1);
+    TRACE_END("dup2", trace.track, start, command->name);
+
+    if (exec_path == NULL)
+        _exit(run_builtin(command, STDIN_FILENO, STDOUT_FILENO));
+    if (tracing())
+        trace_event("exec", 'i', trace.track, trace_clock(), 0, exec_path);
+    execv(exec_path, command->args);
+    fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+    _exit(127);
+}
+
+/**
+ * A stage of the pipeline being executed
+ */
+struct stage
+{
+    struct command_t *command;
+    const char *exec_path; // NULL for builtins
+    pid_t pid;             // -1 if it could not be started or is a thread
+    int status;            // shell style exit status, 128+N for signal N
+    bool threaded;         // builtin running on a thread of the shell
+    pthread_t thread;
+    int in_fd, out_fd;   // pipe ends owned by the thread, -1 for none
+    int input, output;   // what the thread reads and writes
+    int track;           // trace track, stage number from 1
+    struct fd_action *redirects;
+    int redirect_count;
+};
+
+static void *builtin_stage_thread(void *arg)
+{
+    struct stage *stage = arg;
+    TRACE_START(start);
+    stage->status = run_builtin(stage->command, stage->input, stage->output);
+    TRACE_END(stage->command->name, stage->track, start, "thread");
+    // closing our ends is what lets the neighbouring stages see EOF
+    if (stage->in_fd != -1)
+        close(stage->in_fd);
+    if (stage->out_fd != -1)
+        close(stage->out_fd);
+    return NULL;
+}
+
+/**
+ * Run a builtin pipeline stage on a thread of the shell instead of forking.
+ * The redirects are not dup2'ed over the shell's fds, they pick the fds the
+ * thread reads and writes. Only stdin and stdout can be redirected this way,
+ * a stage that redirects another fd or closes one is forked instead. So is
+ * a uniq reading the terminal of an interactive shell: the terminal is the
+ * job's then, and Ctrl-C, Ctrl-Z and Ctrl-D have to reach the stage.
+ * @param  stage  with its redirects prepared, they are released after join
+ * @param  in_fd  pipe to read from, -1 for none. Owned by the thread after.
+ * @param  out_fd pipe to write to, -1 for none. Owned by the thread after.
+ * @return        0 on success, -1 if the stage could not be started, 1 if it
+ *                has to be forked instead (nothing is taken over then)
+ */
+int start_builtin_thread(struct stage *stage, int in_fd, int out_fd)
+{
+    int fds[3] = {in_fd != -1 ? in_fd : STDIN_FILENO,
+                  out_fd != -1 ? out_fd : STDOUT_FILENO, STDERR_FILENO};
+    for (int i = 0; i < stage->redirect_count; i++)
+    {
+        // stderr and the other fds are the whole shell's, not the thread's
+        struct fd_action *action = &stage->redirects[i];
+        if (action->fd > STDOUT_FILENO || action->source == -1)
+            return 1;
+    }
+    for (int i = 0; i < stage->redirect_count; i++)
+    {
+        struct fd_action *action = &stage->redirects[i];
+        if (action->owned || action->source > STDERR_FILENO)
+            fds[action->fd] = action->source;
+        else
+            fds[action->fd] = fds[action->source];
+    }
+    if (interactive && strcmp(stage->command->name, "uniq") == 0 && isatty(fds[0]))
+        return 1;
+    stage->in_fd = in_fd;
+    stage->out_fd = out_fd;
+    stage->input = fds[0];
+    stage->output = fds[1];
+
+    // signals are for the main thread to handle
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int r = pthread_create(&stage->thread, NULL, builtin_stage_thread, stage);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r != 0)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, stage->command->name, strerror(r));
+        if (in_fd != -1)
+            close(in_fd);
+        if (out_fd != -1)
+            close(out_fd);
+        redirect_release(stage->redirects, stage->redirect_count);
+        return -1;
+    }
+    stage->threaded = true;
+    return 0;
+}
+
+// set -e, a batch shell stops at the first line that fails
+bool errexit = false;
+
+/**
+ * set builtin: -e and +e turn errexit on and off
+ * @param  command [description]
+ * @return         SUCCESS
+ */
+int builtin_set(struct command_t *command)
+{
+    for (int i = 0; i < command->arg_count; i++)
+    {
+        if (strcmp(command->args[i], "-e") == 0)
+            errexit = true;
+        else if (strcmp(command->args[i], "+e") == 0)
+            errexit = false;
+        else
+        {
+            printf("-%s: set: %s: invalid option\n", sysname, command->args[i]);
+            last_status = 2;
+        }
+    }
+    return SUCCESS;
+}
+
+// exit status of every stage of the last foreground pipeline
+int last_pipeline_status[64];
+int last_pipeline_length = 0;
+int last_status = 0;
+
+/**
+ * Convert a waitpid status to a shell exit status
+ * @param  status [description]
+ * @return        exit code, or 128 + signal number
+ */
+int exit_status(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 0;
+}
+
+/**
+ * Whether a process killed by a signal is worth a message. SIGPIPE is how
+ * pipelines normally end and SIGINT was the user's own Ctrl-C.
+ * @param  status waitpid status
+ * @return        [description]
+ */
+bool reported_signal(int status)
+{
+    return WIFSIGNALED(status) && WTERMSIG(status) != SIGPIPE &&
+           WTERMSIG(status) != SIGINT;
+}
+
+/**
+ * pipestatus builtin: print the exit status of each stage of the last
+ * foreground pipeline
+ * @param  command [description]
+ * @return         SUCCESS
+ */
+int builtin_pipestatus(struct command_t *command)
+{
+    for (int i = 0; i < last_pipeline_length; i++)
+        printf("%s%d", i ? " " : "", last_pipeline_status[i]);
+    printf("\n");
+    return SUCCESS;
+}
+
+/**
+ * Resource accounting. Every process of a job is reaped with wait4, which
+ * hands over its rusage; when the job leaves the table each process adds its
+ * wall time to a latency histogram of its command name. The histograms have
+ * four log-spaced buckets per power of two microseconds, so a percentile read
+ * from them is within 19% of the real value.
+ */
+#define STATS_BUCKETS (1 + 64 * 4)
+
+struct job_usage
+{
+    double real, user, sys; // seconds
+    long max_rss;           // KB, of the largest process
+    long major_faults;
+};
+
+struct command_stats
+{
+    char *name;
+    unsigned long count;
+    struct job_usage total; // max_rss is the largest seen
+    double max_real;
+    uint32_t buckets[STATS_BUCKETS];
+};
+
+// name -> stats, open addressing with linear probing
+struct command_stats **command_stats = NULL;
+int command_stats_capacity = 0, command_stats_count = 0;
+
+// usage of the jobs finished while a time builtin runs, NULL otherwise
+struct job_usage *time_usage = NULL;
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static double timeval_seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static int latency_bucket(double seconds)
+{
+    uint64_t us = seconds * 1e6;
+    if (us == 0)
+        return 0;
+    int e = 63 - __builtin_clzll(us);
+    int sub = e >= 2 ? (us >> (e - 2)) & 3 : (us << (2 - e)) & 3;
+    return 1 + e * 4 + sub;
+}
+
+/**
+ * Upper limit of a histogram bucket
+ * @param  b [description]
+ * @return   seconds
+ */
+static double bucket_limit(int b)
+{
+    if (b == 0)
+        return 1e-6;
+    int e = (b - 1) / 4, sub = (b - 1) % 4;
+    return (4 + sub + 1) * (double)(1ULL << e) / 4 / 1e6;
+}
+
+static struct command_stats **command_stats_slot(const char *name)
+{
+    int mask = command_stats_capacity - 1;
+    int i = hash_string(name) & mask;
+    while (command_stats[i] && strcmp(command_stats[i]->name, name))
+        i = (i + 1) & mask;
+    return &command_stats[i];
+}
+
+/**
+ * Add the run of one process to the statistics of its command name
+ * @param name  [description]
+ * @param usage [description]
+ */
+void stats_record(const char *name, const struct job_usage *usage)
+{
+    if (2 * (command_stats_count + 1) > command_stats_capacity)
+    {
+        struct command_stats **old = command_stats;
+        int old_capacity = command_stats_capacity;
+        command_stats_capacity = old_capacity ? 2 * old_capacity : 64;
+        command_stats = calloc(command_stats_capacity, sizeof(struct command_stats *));
+        for (int i = 0; i < old_capacity; i++)
+            if (old[i])
+                *command_stats_slot(old[i]->name) = old[i];
+        free(old);
+    }
+    struct command_stats **slot = command_stats_slot(name);
+    if (*slot == NULL)
+    {
+        *slot = calloc(1, sizeof(struct command_stats));
+        (*slot)->name = strdup(name);
+        command_stats_count++;
+    }
+    struct command_stats *stats = *slot;
+    stats->count++;
+    stats->total.real += usage->real;
+    stats->total.user += usage->user;
+    stats->total.sys += usage->sys;
+    stats->total.major_faults += usage->major_faults;
+    if (usage->max_rss > stats->total.max_rss)
+        stats->total.max_rss = usage->max_rss;
+    if (usage->real > stats->max_real)
+        stats->max_real = usage->real;
+    stats->buckets[latency_bucket(usage->real)]++;
+}
+
+/**
+ * Wall time below which a fraction of the runs of a command finished
+ * @param  stats    [description]
+ * @param  fraction 0.5 for the median
+ * @return          seconds, never more than the slowest run
+ */
+double stats_percentile(const struct command_stats *stats, double fraction)
+{
+    unsigned long rank = fraction * stats->count, seen = 0;
+    if (rank < fraction * stats->count || rank == 0)
+        rank++;
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        seen += stats->buckets[b];
+        if (seen >= rank)
+            return bucket_limit(b) < stats->max_real ? bucket_limit(b) : stats->max_real;
+    }
+    return stats->max_real;
+}
+
+static int compare_stats(const void *a, const void *b)
+{
+    return strcmp((*(struct command_stats **)a)->name, (*(struct command_stats **)b)->name);
+}
+
+/**
+ * Format a duration with a unit that keeps it short
+ * @param  buf     [description]
+ * @param  size    [description]
+ * @param  seconds [description]
+ * @return         buf
+ */
+static char *format_duration(char *buf, size_t size, double seconds)
+{
+    if (seconds < 1e-3)
+        snprintf(buf, size, "%.0fus", seconds * 1e6);
+    else if (seconds < 1)
+        snprintf(buf, size, "%.1fms", seconds * 1e3);
+    else
+        snprintf(buf, size, "%.2fs", seconds);
+    return buf;
+}
+
+/**
+ * stats builtin: per command name latency percentiles and resource usage of
+ * every process run this session. stats NAME... limits it to those names,
+ * stats -r forgets everything.
+ * @param  command [description]
+ * @return         SUCCESS
+ */
+int builtin_stats(struct command_t *command)
+{
+    if (command->arg_count == 1 && strcmp(command->args[0], "-r") == 0)
+    {
+        for (int i = 0; i < command_stats_capacity; i++)
+        {
+            if (command_stats[i] == NULL)
+                continue;
+            free(command_stats[i]->name);
+            free(command_stats[i]);
+            command_stats[i] = NULL;
+        }
+        command_stats_count = 0;
+        return SUCCESS;
+    }
+
+    struct command_stats **list = malloc((command_stats_count + 1) * sizeof(*list));
+    int n = 0;
+    for (int i = 0; i < command_stats_capacity; i++)
+        if (command_stats[i])
+            list[n++] = command_stats[i];
+    qsort(list, n, sizeof(*list), compare_stats);
+
+    printf("%-16s %7s %9s %9s %9s %9s %9s %9s %7s\n", "command", "runs", "p50", "p99",
+           "max", "user", "sys", "maxrss", "majflt");
+    for (int i = 0; i < n; i++)
+    {
+        struct command_stats *stats = list[i];
+        bool wanted = command->arg_count == 0;
+        for (int a = 0; a < command->arg_count && !wanted; a++)
+            wanted = strcmp(command->args[a], stats->name) == 0;
+        if (!wanted)
+            continue;
+        char p50[16], p99[16], max[16], user[16], sys[16];
+        printf("%-16s %7lu %9s %9s %9s %9s %9s %7ldKB %7ld\n", stats->name, stats->count,
+               format_duration(p50, sizeof(p50), stats_percentile(stats, 0.5)),
+               format_duration(p99, sizeof(p99), stats_percentile(stats, 0.99)),
+               format_duration(max, sizeof(max), stats->max_real),
+               format_duration(user, sizeof(user), stats->total.user / stats->count),
+               format_duration(sys, sizeof(sys), stats->total.sys / stats->count),
+               stats->total.max_rss, stats->total.major_faults);
+    }
+    free(list);
+    return SUCCESS;
+}
+
+/**
+ * time builtin: run the rest of the line and report the wall time, and the
+ * CPU time, peak memory and major faults of the processes it finished
+ * @param  command command whose name is "time"
+ * @return         what running the rest of the line returns
+ */
+int builtin_time(struct command_t *command)
+{
+    struct job_usage usage = {0, 0, 0, 0, 0};
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int code = SUCCESS;
+    if (command->arg_count > 0)
+    {
+        // the first argument becomes the command, the rest shift down
+        command->name = command->args[0];
+        memmove(command->args, command->args + 1,
+                (command->arg_count - 1) * sizeof(char *));
+        command->arg_count--;
+        time_usage = &usage;
+        code = process_command(command);
+        time_usage = NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (code == EXIT)
+        return code;
+
+    usage.real = elapsed(&start, &end);
+    const char *labels[] = {"real", "user", "sys"};
+    double times[] = {usage.real, usage.user, usage.sys};
+    fprintf(stderr, "\n");
+    for (int i = 0; i < 3; i++)
+    {
+        int minutes = times[i] / 60;
+        fprintf(stderr, "%s\t%dm%.3fs\n", labels[i], minutes, times[i] - 60 * minutes);
+    }
+    fprintf(stderr, "maxrss\t%ldKB\nmajflt\t%ld\n", usage.max_rss, usage.major_faults);
+    return code;
+}
+
+/**
+ * Job table. Every pipeline that starts processes becomes a job; foreground
+ * jobs leave the table when they finish, background and stopped ones stay
+ * until their completion has been reported. Children are reaped by the
+ * SIGCHLD handler as soon as they exit, which finds the process through a
+ * pid map and records its status. The table and the map are only changed by
+ * the main thread with SIGCHLD blocked, the handler never allocates.
+ */
+typedef enum
+{
+    JOB_RUNNING = 0,
+    JOB_STOPPED,
+    JOB_DONE,
+} JOB_STATE;
+
+const char *job_state_names[] = {"Running", "Stopped", "Done"};
+
+struct job;
+
+struct job_proc
+{
+    pid_t pid;
+    struct job *job;
+    volatile sig_atomic_t state; // JOB_STATE of this process
+    volatile int status;         // last waitpid status
+    char *name;                  // command name, for the statistics
+    struct timespec end;         // when it was reaped
+    struct rusage usage;         // as reported by wait4 once it is done
+    int track;                   // trace track of its stage
+};
+
+struct job
+{
+    int id; // job number, %id
+    pid_t pgid;
+    int nprocs;
+    struct job_proc *procs;
+    struct timespec start; // when its first process was started
+    char *text; // command line, for listings
+    bool background;
+    bool notified; // last state change has been reported
+    JOB_STATE reported;
+    struct stage *stages; // pinned in the command arena while threads of a
+    int nstages;          // stopped job still run its builtin stages
+};
+
+struct job **jobs = NULL; // in order of creation, the last one is current
+int job_count = 0, job_capacity = 0;
+
+// pid -> process, open addressing with linear probing
+struct job_proc **pid_map = NULL;
+int pid_map_capacity = 0, pid_map_count = 0;
+
+static struct job_proc **pid_map_slot(pid_t pid)
+{
+    int mask = pid_map_capacity - 1;
+    int i = (pid * 2654435761u) & mask;
+    while (pid_map[i] && pid_map[i]->pid != pid)
+        i = (i + 1) & mask;
+    return &pid_map[i];
+}
+
+static void pid_map_insert(struct job_proc *proc)
+{
+    if (2 * (pid_map_count + 1) > pid_map_capacity)
+    {
+        struct job_proc **old = pid_map;
+        int old_capacity = pid_map_capacity;
+        pid_map_capacity = old_capacity ? 2 * old_capacity : 256;
+        pid_map = calloc(pid_map_capacity, sizeof(struct job_proc *));
+        for (int i = 0; i < old_capacity; i++)
+            if (old[i])
+                *pid_map_slot(old[i]->pid) = old[i];
+        free(old);
+    }
+    *pid_map_slot(proc->pid) = proc;
+    pid_map_count++;
+}
+
+static void pid_map_remove(pid_t pid)
+{
+    struct job_proc **slot = pid_map_slot(pid);
+    if (*slot == NULL)
+        return;
+    *slot = NULL;
+    pid_map_count--;
+    // re-insert the rest of the cluster so lookups never stop early
+    int mask = pid_map_capacity - 1;
+    for (int i = (slot - pid_map + 1) & mask; pid_map[i]; i = (i + 1) & mask)
+    {
+        struct job_proc *proc = pid_map[i];
+        pid_map[i] = NULL;
+        *pid_map_slot(proc->pid) = proc;
+    }
+}
+
+/**
+ * Reap every child that changed state and record it in the job table
+ * @param sig [description]
+ */
+void sigchld_handler(int sig)
+{
+    int saved_errno = errno, status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+    {
+        struct job_proc *proc = pid_map_capacity ? *pid_map_slot(pid) : NULL;
+        if (proc == NULL)
+            continue; // not a job process, e.g. a helper wiseman forked
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+        {
+            clock_gettime(CLOCK_MONOTONIC, &proc->end);
+            proc->usage = usage;
+        }
+        proc->status = status;
+        proc->state = WIFSTOPPED(status)     ? JOB_STOPPED
+                      : WIFCONTINUED(status) ? JOB_RUNNING
+                                             : JOB_DONE;
+    }
+    errno = saved_errno;
+}
+
+static void block_sigchld(sigset_t *old)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+
+/**
+ * Aggregate state of a job: running while any process runs, done once all are
+ * @param  job [description]
+ * @return     [description]
+ */
+JOB_STATE job_state(struct job *job)
+{
+    bool stopped = false;
+    for (int i = 0; i < job->nprocs; i++)
+    {
+        if (job->procs[i].state == JOB_RUNNING)
+            return JOB_RUNNING;
+        if (job->procs[i].state == JOB_STOPPED)
+            stopped = true;
+    }
+    return stopped ? JOB_STOPPED : JOB_DONE;
+}
+
+/**
+ * Reconstruct the command line of a pipeline for job listings
+ * @param  command command chain with exec-ready argument vectors
+ * @return         malloc'ed text
+ */
+char *command_text(struct command_t *command)
+{
+    size_t len = 1;
+    for (struct command_t *c = command; c; c = c->next)
+        for (int i = 0; c->args[i]; i++)
+            len += strlen(c->args[i]) + 3;
+    char *text = malloc(len + 2), *w = text;
+    for (struct command_t *c = command; c; c = c->next)
+    {
+        for (int i = 0; c->args[i]; i++)
+            w += sprintf(w, "%s%s", i ? " " : "", c->args[i]);
+        if (c->next)
+            w += sprintf(w, " | ");
+    }
+    if (command->background)
+        w += sprintf(w, " &");
+    *w = 0;
+    return text;
+}
+
+/**
+ * Add a started pipeline to the job table. Call with SIGCHLD blocked, before
+ * any of its processes can be reaped.
+ * @param  pgid    [description]
+ * @param  stages  the stages with a pid become the processes of the job
+ * @param  n       number of stages
+ * @param  nprocs  number of them that are processes
+ * @param  command [description]
+ * @param  start   when the first stage was started
+ * @return         the new job
+ */
+struct job *job_add(pid_t pgid, struct stage *stages, int n, int nprocs,
+                    struct command_t *command, const struct timespec *start)
+{
+    struct job *job = calloc(1, sizeof(struct job));
+    job->id = job_count ? jobs[job_count - 1]->id + 1 : 1;
+    job->pgid = pgid;
+    job->start = *start;
+    job->nprocs = nprocs;
+    job->procs = calloc(nprocs, sizeof(struct job_proc));
+    job->text = command_text(command);
+    job->background = command->background;
+    for (int i = 0, p = 0; i < n; i++)
+    {
+        if (stages[i].pid == -1)
+            continue;
+        struct job_proc *proc = &job->procs[p++];
+        proc->pid = stages[i].pid;
+        proc->job = job;
+        proc->state = JOB_RUNNING;
+        proc->name = strdup(stages[i].command->name);
+        proc->track = stages[i].track;
+        pid_map_insert(proc);
+    }
+    if (job_count == job_capacity)
+    {
+        job_capacity = job_capacity ? 2 * job_capacity : 16;
+        jobs = realloc(jobs, job_capacity * sizeof(struct job *));
+    }
+    jobs[job_count++] = job;
+    return job;
+}
+
+/**
+ * Trace how the processes of a finished job ran and exited, and how long the
+ * shell took to reap the job after the last one exited
+ * @param job [description]
+ */
+static void trace_job(struct job *job)
+{
+    double start = job->start.tv_sec * 1e6 + job->start.tv_nsec / 1e3, last = start;
+    for (int p = 0; p < job->nprocs; p++)
+    {
+        struct job_proc *proc = &job->procs[p];
+        if (proc->state != JOB_DONE)
+            continue;
+        double end = proc->end.tv_sec * 1e6 + proc->end.tv_nsec / 1e3;
+        char status[32];
+        snprintf(status, sizeof(status), "%d", exit_status(proc->status));
+        trace_event(proc->name, 'X', proc->track, start, end, job->text);
+        trace_event("exit", 'i', proc->track, end, end, status);
+        if (end > last)
+            last = end;
+    }
+    trace_event("reap", 'X', 0, last, trace_clock(), job->text);
+}
+
+/**
+ * Join the builtin stages a job stopped with Ctrl-Z left running on threads,
+ * and unpin the arena they live in. Once the job's processes are done their
+ * pipe ends are closed, so the threads are finishing too.
+ * @param  job [description]
+ * @return     exit status of the last stage if it ran on a thread, -1 if not
+ */
+int job_join_threads(struct job *job)
+{
+    if (job->stages == NULL)
+        return -1;
+    for (int i = 0; i < job->nstages; i++)
+    {
+        if (!job->stages[i].threaded)
+            continue;
+        pthread_join(job->stages[i].thread, NULL);
+        redirect_release(job->stages[i].redirects, job->stages[i].redirect_count);
+    }
+    struct stage *last = &job->stages[job->nstages - 1];
+    int status = last->threaded ? last->status : -1;
+    job->stages = NULL;
+    command_arena.pins--;
+    return status;
+}
+
+/**
+ * Remove a job from the table and free it, accounting the processes that
+ * finished. Call with SIGCHLD blocked.
+ * @param job [description]
+ */
+void job_remove(struct job *job)
+{
+    int i = 0;
+    while (i < job_count && jobs[i] != job)
+        i++;
+    if (i == job_count)
+        return;
+    memmove(&jobs[i], &jobs[i + 1], (job_count - i - 1) * sizeof(struct job *));
+    job_count--;
+    job_join_threads(job);
+    if (tracing())
+        trace_job(job);
+    for (int p = 0; p < job->nprocs; p++)
+    {
+        struct job_proc *proc = &job->procs[p];
+        pid_map_remove(proc->pid);
+        if (proc->state == JOB_DONE)
+        {
+            struct job_usage usage = {
+                elapsed(&job->start, &proc->end), timeval_seconds(&proc->usage.ru_utime),
+                timeval_seconds(&proc->usage.ru_stime), proc->usage.ru_maxrss,
+                proc->usage.ru_majflt};
+            stats_record(proc->name, &usage);
+            if (time_usage != NULL)
             {
-                for (int i = 0; i < unique_words_size; i++)
-                {
-                    int count = 0;
-                    if (unique_words[i] != NULL)
-                    {
-                        for (int j = 0; j < word_count; j++)
-                        {
-                            if (words[j] != NULL)
-                            {
-                                if (!strcmp(unique_words[i], words[j]))
-                                {
-                                    count++;
-                                }
-                            }
-                        }
-                    }
-                    if (count != 0)
-                    {
-                        printf("From our uniq count: \t %d %s\n", count, unique_words[i]);
-                    }
-                }
+                time_usage->user += usage.user;
+                time_usage->sys += usage.sys;
+                time_usage->major_faults += usage.major_faults;
+                if (usage.max_rss > time_usage->max_rss)
+                    time_usage->max_rss = usage.max_rss;
             }
         }
-        // implementation of the wiseman command
-        if (!strcmp(command->name, "wiseman"))
-        {
-            // find the path of fortune command
-            char *fortune = "/usr/games/fortune";
-            char *fortune_arg[2] = {fortune, NULL};
-            // open pipe
-            int pipefd_e[2];
-            pipe(pipefd_e);
-            char read_message[1024];
-            // Execute fortune and read it's STDOUT using read_message array
-            pid_t pid_wiseman = fork();
-            if (pid_wiseman == 0)
+        free(proc->name);
+    }
+    free(job->procs);
+    free(job->text);
+    free(job);
+}
+
+/**
+ * Describe how a finished job ended, from the status of its last process
+ * @param  job [description]
+ * @param  buf [description]
+ * @param  len [description]
+ * @return     buf
+ */
+static char *job_describe(struct job *job, char *buf, size_t len)
+{
+    JOB_STATE state = job_state(job);
+    int status = job->procs[job->nprocs - 1].status;
+    if (state == JOB_DONE && WIFSIGNALED(status))
+        snprintf(buf, len, "%s", strsignal(WTERMSIG(status)));
+    else if (state == JOB_DONE && WEXITSTATUS(status))
+        snprintf(buf, len, "Exit %d", WEXITSTATUS(status));
+    else
+        snprintf(buf, len, "%s", job_state_names[state]);
+    return buf;
+}
+
+static void job_print(struct job *job)
+{
+    char state[64];
+    char mark = job == jobs[job_count - 1]                      ? '+'
+                : job_count > 1 && job == jobs[job_count - 2] ? '-'
+                                                              : ' ';
+    printf("[%d]%c  %-24s%s\n", job->id, mark,
+           job_describe(job, state, sizeof(state)), job->text);
+}
+
+/**
+ * Report background jobs that finished or stopped since the last prompt, and
+ * drop the finished ones from the table
+ */
+void notify_jobs()
+{
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < job_count; i++)
+    {
+        struct job *job = jobs[i];
+        JOB_STATE state = job_state(job);
+        if (state == JOB_RUNNING || (job->notified && job->reported == state))
+            continue;
+        job_print(job);
+        job->notified = true;
+        job->reported = state;
+        if (state == JOB_DONE)
+        {
+            job_remove(job);
+            i--;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * Drop the finished jobs from the table without reporting them, for batch
+ * mode, where there is no prompt to print notices before
+ */
+void reap_jobs()
+{
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < job_count; i++)
+    {
+        if (job_state(jobs[i]) == JOB_DONE)
+        {
+            job_remove(jobs[i]);
+            i--;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * Wait until a foreground job finishes or stops, with the terminal handed to
+ * its process group meanwhile. Call with SIGCHLD blocked.
+ * @param  job      [description]
+ * @param  old_mask signal mask to wait with
+ * @return          final state of the job
+ */
+JOB_STATE wait_for_job(struct job *job, sigset_t *old_mask)
+{
+    job->background = false;
+    if (interactive)
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    JOB_STATE state;
+    while ((state = job_state(job)) == JOB_RUNNING)
+        sigsuspend(old_mask);
+    if (interactive)
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+    if (state == JOB_STOPPED)
+    {
+        printf("\n");
+        job->notified = true;
+        job->reported = state;
+        job_print(job);
+        return state;
+    }
+    last_status = exit_status(job->procs[job->nprocs - 1].status);
+    return state;
+}
+
+/**
+ * Find the job a jobs/fg/bg/wait argument refers to: %N or N for a job number,
+ * nothing for the current job
+ * @param  spec argument, NULL for the current job
+ * @param  name builtin name for the error message
+ * @return      job, NULL with a message if there is none
+ */
+struct job *find_job(const char *spec, const char *name)
+{
+    if (spec == NULL)
+    {
+        if (job_count == 0)
+        {
+            printf("-%s: %s: no current job\n", sysname, name);
+            return NULL;
+        }
+        return jobs[job_count - 1];
+    }
+    int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+    for (int i = 0; i < job_count; i++)
+        if (jobs[i]->id == id)
+            return jobs[i];
+    printf("-%s: %s: %s: no such job\n", sysname, name, spec);
+    return NULL;
+}
+
+/**
+ * Send SIGCONT to a stopped job and mark its processes running again
+ * @param job [description]
+ */
+static void job_continue(struct job *job)
+{
+    for (int i = 0; i < job->nprocs; i++)
+        if (job->procs[i].state == JOB_STOPPED)
+            job->procs[i].state = JOB_RUNNING;
+    job->notified = false;
+    kill(-job->pgid, SIGCONT);
+}
+
+/**
+ * jobs builtin: list the job table
+ * @param  command [description]
+ * @return         SUCCESS
+ */
+int builtin_jobs(struct command_t *command)
+{
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < job_count; i++)
+    {
+        job_print(jobs[i]);
+        if (job_state(jobs[i]) != JOB_RUNNING)
+        {
+            jobs[i]->notified = true;
+            jobs[i]->reported = job_state(jobs[i]);
+        }
+    }
+    for (int i = 0; i < job_count; i++)
+    {
+        if (job_state(jobs[i]) == JOB_DONE)
+            job_remove(jobs[i--]);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return SUCCESS;
+}
+
+/**
+ * fg builtin: continue a job in the foreground and wait for it
+ * @param  command [description]
+ * @return         SUCCESS
+ */
+int builtin_fg(struct command_t *command)
+{
+    sigset_t old;
+    block_sigchld(&old);
+    struct job *job = find_job(command->arg_count ? command->args[0] : NULL, "fg");
+    if (job != NULL)
+    {
+        printf("%s\n", job->text);
+        fflush(stdout);
+        term_cooked();
+        job_continue(job);
+        if (wait_for_job(job, &old) == JOB_DONE)
+        {
+            int status = job->procs[job->nprocs - 1].status;
+            if (reported_signal(status))
+                fprintf(stderr, "-%s: %s: %s\n", sysname, job->text,
+                        strsignal(WTERMSIG(status)));
+            if ((status = job_join_threads(job)) != -1)
+                last_status = status;
+            job_remove(job);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return SUCCESS;
+}
+
+/**
+ * bg builtin: continue a stopped job in the background
+ * @param  command [description]
+ * @return         SUCCESS
+ */
+int builtin_bg(struct command_t *command)
+{
+    sigset_t old;
+    block_sigchld(&old);
+    struct job *job = find_job(command->arg_count ? command->args[0] : NULL, "bg");
+    if (job != NULL)
+    {
+        job->background = true;
+        job_continue(job);
+        printf("[%d]  %s\n", job->id, job->text);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return SUCCESS;
+}
+
+/**
+ * wait builtin: wait for the given jobs, or for every running job
+ * @param  command [description]
+ * @return         SUCCESS
+ */
+int builtin_wait(struct command_t *command)
+{
+    sigset_t old;
+    block_sigchld(&old);
+    int waited = 0;
+    for (int a = 0; a < command->arg_count || (a == 0 && waited == 0); a++)
+    {
+        struct job *job = NULL;
+        if (command->arg_count)
+        {
+            if ((job = find_job(command->args[a], "wait")) == NULL)
+                continue;
+        }
+        else
+        {
+            // the last job still running, until there are none
+            for (int i = job_count - 1; i >= 0 && job == NULL; i--)
+                if (job_state(jobs[i]) == JOB_RUNNING)
+                    job = jobs[i];
+            if (job == NULL)
+                break;
+            a--;
+        }
+        while (job_state(job) == JOB_RUNNING)
+            sigsuspend(&old);
+        if (job_state(job) == JOB_DONE)
+        {
+            last_status = exit_status(job->procs[job->nprocs - 1].status);
+            int status = job_join_threads(job);
+            if (status != -1)
+                last_status = status;
+            job_remove(job);
+        }
+        waited++;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return SUCCESS;
+}
+
+/**
+ * Prepare a command for exec: append the NULL terminator and put the name in
+ * front, as required by exec. Done in the parent so every launcher shares it.
+ * @param command [description]
+ */
+void build_argv(struct command_t *command)
+{
+    // increase args size by 2
+    command->args = arena_realloc(&command_arena, command->args,
+                                  sizeof(char *) * command->arg_count,
+                                  sizeof(char *) * (command->arg_count + 2));
+    command->arg_count += 2;
+
+    // shift everything forward by 1
+    for (int i = command->arg_count - 2; i > 0; --i)
+        command->args[i] = command->args[i - 1];
+
+    // set args[0] as a copy of name
+    command->args[0] = command->name;
+    // set args[arg_count-1] (last) to NULL
+    command->args[command->arg_count - 1] = NULL;
+}
+
+int run_command(struct command_t *command);
+
+int process_command(struct command_t *command)
+{
+    if (!tracing())
+        return run_command(command);
+    double start = trace_clock();
+    int code = run_command(command);
+    trace_event("command", 'X', 0, start, trace_clock(), command->name);
+    return code;
+}
+
+int run_command(struct command_t *command)
+{
+    int r;
+    if (strcmp(command->name, "") == 0)
+        return SUCCESS;
+
+    if (strcmp(command->name, "time") == 0)
+        return builtin_time(command);
+
+    if (strcmp(command->name, "exit") == 0)
+    {
+        if (command->arg_count > 0)
+            last_status = atoi(command->args[0]) & 0xFF;
+        return EXIT;
+    }
+
+    // builtins that change the shell itself only make sense on their own
+    if (command->next == NULL)
+    {
+        last_status = 0; // unless the builtin fails
+
+        if (strcmp(command->name, "set") == 0)
+            return builtin_set(command);
+
+        if (strcmp(command->name, "hash") == 0)
+            return builtin_hash(command);
+
+        if (strcmp(command->name, "launcher") == 0)
+            return builtin_launcher(command);
+
+        if (strcmp(command->name, "memstat") == 0)
+            return builtin_memstat(command);
+
+        if (strcmp(command->name, "pipestatus") == 0)
+            return builtin_pipestatus(command);
+
+        if (strcmp(command->name, "stats") == 0)
+            return builtin_stats(command);
+
+        if (strcmp(command->name, "jobs") == 0)
+            return builtin_jobs(command);
+
+        if (strcmp(command->name, "fg") == 0)
+            return builtin_fg(command);
+
+        if (strcmp(command->name, "bg") == 0)
+            return builtin_bg(command);
+
+        if (strcmp(command->name, "wait") == 0)
+            return builtin_wait(command);
+
+        if (strcmp(command->name, "cd") == 0)
+        {
+            const char *dir = command->arg_count > 0 ? command->args[0] : getenv("HOME");
+            r = chdir(dir ? dir : "/");
+            if (r == -1)
             {
-                close(pipefd_e[0]);
-                dup2(pipefd_e[1], STDOUT_FILENO);
-                execv(fortune, fortune_arg);
+                printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+                last_status = 1;
             }
             else
             {
-                wait(NULL);
-                close(pipefd_e[1]);
-                read(pipefd_e[0], read_message, sizeof(read_message));
-                close(pipefd_e[0]);
-                printf("read message is: %s\n", read_message);
-                // find path of crontab
-                char *cronfile_name = "fortune_cron";
-                char *crontab = "/usr/bin/crontab";
-                char *crontab_args[3] = {crontab, cronfile_name, NULL};
-                char crontab_cmd[2048];
-                // check for wiseman if it has enough arguments
-                if (command->args[1] == NULL)
-                {
-                    fprintf(stderr, "Wiseman argument not provided!\n");
-                    return UNKNOWN;
-                }
-                // since we add newline for crontab so we delete newline of read_message
-                read_message[strlen(read_message) - 1] = 0;
-                // crontab_cmd is syntax of our cronjob 
-                sprintf(crontab_cmd, "*/%s * * * * DISPLAY=0 espeak \"%s\"\n", command->args[1], read_message);
-                printf("%s\n", crontab_cmd);
-                // write cronjob to a file then give as an argument to crontab
-                FILE *file = fopen(cronfile_name, "w");
-                if (file == NULL)
-                {
-                    perror("File opening error");
-                }
-                if (fwrite(crontab_cmd, sizeof(char), strlen(crontab_cmd), file) == -1)
-                {
-                    perror("Writing error");
-                }
-                fclose(file);
-                // execute crontab
-                pid_t pid_cron = fork();
-                if (pid_cron == 0)
-                {
-                    execv(crontab, crontab_args);
-                }
-                else
-                {
-                    wait(NULL);
-                }
-                remove(cronfile_name);
-                return SUCCESS;
+                prompt_set_cwd();
+                path_cache_chdir();
+            }
+            return SUCCESS;
+        }
+    }
+
+    int n = 0;
+    for (struct command_t *c = command; c; c = c->next)
+        n++;
+    struct stage *stages = arena_alloc(&command_arena, n * sizeof(struct stage));
+
+    // resolve every stage in the parent, so each child only execs once
+    struct command_t *c = command;
+    for (int i = 0; i < n; i++, c = c->next)
+    {
+        stages[i].command = c;
+        stages[i].track = i + 1;
+        if (strcmp(c->name, "uniq") && strcmp(c->name, "wiseman"))
+        {
+            TRACE_START(resolve_start);
+            stages[i].exec_path = resolve_command(c->name);
+            TRACE_END("resolve", i + 1, resolve_start, c->name);
+            if (stages[i].exec_path == NULL)
+            {
+                printf("-%s: %s: command not found\n", sysname, c->name);
+                last_status = 127;
+                return UNKNOWN;
             }
         }
-        // Path of commands for execv to execute
-        char *path1 = "/usr/bin/";
-        char *path2 = "/bin/";
-        // create full path of commands then give to execv
-        char *path1_command = (char *)malloc(
-            (strlen(command->name) + strlen(path1) + 1) * sizeof(char));
-        strcpy(path1_command, path1);
-        strcat(path1_command, command->name);
-        command->args[0] = path1_command;
-        int exec1 = execv(path1_command, command->args);
-        if (exec1 == -1)
-        {
-            char *path2_command = (char *)malloc(
-                (strlen(command->name) + strlen(path2) + 1) * sizeof(char));
-            strcpy(path2_command, path2);
-            strcat(path2_command, command->name);
-            command->args[0] = path2_command;
-            int exec2 = execv(path2_command, command->args);
-            if (exec2 == -1)
+        build_argv(c);
+    }
+
+    // every pipe is created up front, close-on-exec so that each exec'ed
+    // stage keeps only the two ends it dup'ed
+    int(*pipes)[2] = arena_alloc(&command_arena, (n - 1) * sizeof(int[2]) + 1);
+    for (int i = 0; i < n - 1; i++)
+    {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1)
+        {
+            printf("-%s: pipe: %s\n", sysname, strerror(errno));
+            while (i--)
             {
-                fprintf(stderr, "couldnt create execution!\n");
-                return SUCCESS;
+                close(pipes[i][0]);
+                close(pipes[i][1]);
             }
+            return UNKNOWN;
         }
     }
-    else
+
+    // don't let a forked child inherit (and flush again) pending output
+    fflush(stdout);
+    // foreground jobs get the terminal the way the user configured it
+    if (!command->background)
+        term_cooked();
+
+    // no child may be reaped before its job is in the table
+    sigset_t old_mask;
+    block_sigchld(&old_mask);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // all stages join the process group of the first one
+    pid_t pgid = 0;
+    launch_foreground = !command->background;
+    if (tracing())
+        trace_name_tracks(n);
+    for (int i = 0; i < n; i++)
     {
-        // Recursive pipe calls, close pipefd[1]
-        if (is_piped)
+        int in_fd = i > 0 ? pipes[i - 1][0] : -1;
+        int out_fd = i < n - 1 ? pipes[i][1] : -1;
+        stages[i].pid = -1;
+        TRACE_START(redirect_start);
+        int count = redirect_prepare(stages[i].command, &stages[i].redirects);
+        TRACE_END("redirect", i + 1, redirect_start, stages[i].command->name);
+        if (count == -1)
         {
-            // wait(NULL);
-            close(pipefd[1]);
-            process_command(command->next, pipefd);
+            stages[i].status = 1;
+            if (in_fd != -1)
+                close(in_fd);
+            if (out_fd != -1)
+                close(out_fd);
+            continue;
         }
-        // handle background process
-        if (!command->background)
+        stages[i].redirect_count = count;
+        // foreground builtins run on a thread, the fds go with it.
+        // Background ones fork, they outlive this line's arena.
+        if (!command->background && stages[i].exec_path == NULL)
         {
-            waitpid(pid, NULL, 0);
-            return SUCCESS;
+            int r = start_builtin_thread(&stages[i], in_fd, out_fd);
+            if (r == -1)
+                stages[i].status = 1;
+            if (r != 1)
+                continue;
         }
+        TRACE_START(launch_start);
+        trace.track = i + 1;
+        bool spawn = launcher == LAUNCH_SPAWN && stages[i].exec_path != NULL;
+        if (spawn)
+            stages[i].pid = spawn_command(stages[i].command, stages[i].exec_path,
+                                          in_fd, out_fd, pgid, stages[i].redirects, count);
+        else
+            stages[i].pid = fork_command(stages[i].command, stages[i].exec_path,
+                                         in_fd, out_fd, pgid, pipes, n - 1,
+                                         stages[i].redirects, count);
+        TRACE_END(spawn ? "spawn" : "fork", i + 1, launch_start, stages[i].command->name);
+        if (stages[i].pid == -1)
+            stages[i].status = 127;
         else
         {
-            printf("%s is in background process!", command->name);
-            return SUCCESS;
+            bool leader = pgid == 0;
+            if (leader)
+                pgid = stages[i].pid;
+            setpgid(stages[i].pid, pgid); // either side may win the race
+            // and for the terminal too, before the next stage starts
+            if (leader && launch_foreground && interactive)
+                tcsetpgrp(STDIN_FILENO, pgid);
         }
+        // the child has its copies now
+        if (in_fd != -1)
+            close(in_fd);
+        if (out_fd != -1)
+            close(out_fd);
+        redirect_release(stages[i].redirects, count);
+    }
+
+    launch_foreground = false;
+    int nprocs = 0;
+    for (int i = 0; i < n; i++)
+        if (stages[i].pid != -1)
+            nprocs++;
+    struct job *job = nprocs ? job_add(pgid, stages, n, nprocs, command, &start) : NULL;
+
+    // handle background process
+    if (command->background)
+    {
+        if (job != NULL)
+            printf("[%d] %d\n", job->id, pgid);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return SUCCESS;
     }
 
-    // TODO: your implementation here
+    JOB_STATE state = job ? wait_for_job(job, &old_mask) : JOB_DONE;
+    // the threads of a stopped job wait on its stopped processes, they are
+    // joined when the job is done and keep this line's arena until then
+    bool running = false;
+    for (int i = 0; i < n; i++)
+    {
+        if (stages[i].threaded && state == JOB_STOPPED)
+            running = true;
+        else if (stages[i].threaded)
+        {
+            pthread_join(stages[i].thread, NULL);
+            redirect_release(stages[i].redirects, stages[i].redirect_count);
+        }
+    }
+    if (running)
+    {
+        job->stages = stages;
+        job->nstages = n;
+        command_arena.pins++;
+    }
+    for (int i = 0, p = 0; i < n; i++)
+    {
+        if (stages[i].pid == -1)
+            continue;
+        int status = job->procs[p++].status;
+        stages[i].status = exit_status(status);
+        if (state == JOB_DONE && reported_signal(status))
+            fprintf(stderr, "-%s: %s: %s\n", sysname, stages[i].command->name,
+                    strsignal(WTERMSIG(status)));
+    }
+    if (job != NULL && state == JOB_DONE)
+        job_remove(job);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
 
-    printf("-%s: %s: command not found\n", sysname, command->name);
-    return UNKNOWN;
+    last_pipeline_length = n < 64 ? n : 64;
+    for (int i = 0; i < last_pipeline_length; i++)
+        last_pipeline_status[i] = running && stages[i].threaded ? 0 : stages[i].status;
+    last_status = running && stages[n - 1].threaded ? 0 : stages[n - 1].status;
+    return SUCCESS;
 }
\ No newline at end of file